@@ -0,0 +1,747 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Phases are timed with the same private functions compression uses, so
+ * the library is compiled into the benchmark itself.  */
+#include "./huffman.c"
+
+
+#define DEFAULT_SIZE        ((size_t)8 << 20)
+#define DEFAULT_RUNS        10
+#define DEFAULT_WARMUP      2
+#define MAX_RUNS            1000000
+
+#define SEED                0x9E3779B97F4A7C15ull
+
+
+enum phase {
+    PHASE_HISTOGRAM = 0,    /* Counting byte values.  */
+    PHASE_BUILD,            /* Tree, code lengths, encode and decode tables.  */
+    PHASE_ENCODE,
+    PHASE_DECODE,
+    PHASE_COMPRESS,         /* Whole huffman_compress_ctx.  */
+    PHASE_DECOMPRESS,       /* Whole huffman_decompress_ctx.  */
+    PHASE_CONTEXT_COMPRESS, /* Same with HUFFMAN_MAX_CLUSTERS clusters.  */
+    PHASE_CONTEXT_DECOMPRESS,
+    PHASE_ADAPTIVE_ENCODE,  /* Whole input by huffman_adaptive_encode.  */
+    PHASE_ADAPTIVE_DECODE,
+    PHASES
+};
+
+
+static char const * const phase_names[PHASES] = {
+    "histogram", "build", "encode", "decode", "compress", "decompress",
+    "ctx-comp", "ctx-decomp", "adapt-enc", "adapt-dec"
+};
+
+
+struct generator {
+    char const * name;
+    void (* fill)(uint8_t * dst, size_t n, uint64_t * state);
+};
+
+
+struct options {
+    size_t          size;
+    unsigned        runs, warmup;
+    bool            csv;
+    char const *    generator;  /* NULL for all.  */
+    char const *    kernel;     /* NULL for all supported.  */
+};
+
+
+/* Timings of one phase over all runs, in nanoseconds.  */
+struct samples {
+    uint64_t *  ns;
+    unsigned    size;
+};
+
+
+void print_usage(FILE *);
+
+bool parse_size(char const *, size_t *);
+
+/* Parse number of runs, without suffix, up to MAX_RUNS.  */
+bool parse_count(char const *, unsigned *);
+
+uint64_t next_random(uint64_t * state);
+
+uint64_t now_ns(void);
+
+/* Input generators, deterministic for given state.  */
+
+void fill_uniform(uint8_t * dst, size_t n, uint64_t * state);
+
+/* Byte values with Zipf distribution of exponent 1.1.  */
+void fill_zipf(uint8_t * dst, size_t n, uint64_t * state);
+
+void fill_single(uint8_t * dst, size_t n, uint64_t * state);
+
+/* Words of common English chosen by their frequency.  */
+void fill_english(uint8_t * dst, size_t n, uint64_t * state);
+
+/* Records of an event log serialized as JSON.  */
+void fill_json(uint8_t * dst, size_t n, uint64_t * state);
+
+/* Fixed-size little endian records: ids, timestamps, small counters and
+ * floats.  */
+void fill_records(uint8_t * dst, size_t n, uint64_t * state);
+
+/* Compress src with every supported kernel and check that outputs are
+ * identical and decompress back. Returns compressed size or HUFFMAN_ERROR
+ * if kernels disagree or compression fails.  */
+size_t check_kernels(uint8_t const * src, size_t n, uint8_t * packed,
+    uint8_t * unpacked, size_t bound);
+
+/* Run phases on src of generator warmup + runs times, recording timings of
+ * the last runs ones. Coding phases are skipped for inputs of a single byte
+ * value, which are not coded. Stores size of output of each compressing
+ * phase at sizes[phase]. Returns false, after printing which phase failed,
+ * if a phase fails or there is not enough memory.  */
+bool run_phases(char const * generator, uint8_t const * src, size_t n,
+    uint8_t * packed, uint8_t * unpacked, size_t bound,
+    struct options const *, struct samples * samples, size_t * sizes);
+
+int compare_ns(void const *, void const *);
+
+/* Time at given percentile of samples, which get sorted.  */
+uint64_t percentile(struct samples *, unsigned percent);
+
+void report(struct options const *, char const * generator,
+    char const * kernel, enum phase, size_t n, struct samples *,
+    double ratio);
+
+
+static struct generator const generators[] = {
+    { "uniform",    fill_uniform },
+    { "zipf",       fill_zipf },
+    { "single",     fill_single },
+    { "english",    fill_english },
+    { "json",       fill_json },
+    { "records",    fill_records },
+};
+
+#define GENERATORS  (sizeof(generators) / sizeof(generators[0]))
+
+
+int main(int argc, char ** argv) {
+    struct options o;
+    memset(&o, 0, sizeof(o));
+    o.size      = DEFAULT_SIZE;
+    o.runs      = DEFAULT_RUNS;
+    o.warmup    = DEFAULT_WARMUP;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:r:w:g:k:ch")) != -1) {
+        switch (c) {
+            case 'n':
+                if (!parse_size(optarg, &o.size) || o.size == 0) {
+                    fprintf(stderr, "bench: invalid size '%s'\n", optarg);
+                    return 2;
+                }
+                break;
+
+            case 'r':
+                if (!parse_count(optarg, &o.runs) || o.runs == 0) {
+                    fprintf(stderr, "bench: invalid runs '%s'\n", optarg);
+                    return 2;
+                }
+                break;
+
+            case 'w':
+                if (!parse_count(optarg, &o.warmup)) {
+                    fprintf(stderr, "bench: invalid warmup '%s'\n", optarg);
+                    return 2;
+                }
+                break;
+
+            case 'g': o.generator   = optarg;       break;
+            case 'k': o.kernel      = optarg;       break;
+            case 'c': o.csv         = true;         break;
+
+            case 'h':
+                print_usage(stdout);
+                return 0;
+
+            default:
+                print_usage(stderr);
+                return 2;
+        }
+    }
+
+    if (optind != argc) {
+        print_usage(stderr);
+        return 2;
+    }
+
+    /* Adaptive codes may be longer than bytes they code.  */
+    struct huffman_adaptive * a = huffman_adaptive_create();
+    size_t bound = huffman_compress_bound(o.size);
+    size_t adaptive_bound = a != NULL ? huffman_adaptive_bound(a, o.size) : 0;
+    huffman_adaptive_free(a);
+
+    uint8_t * src       = malloc(o.size);
+    uint8_t * packed    = malloc(bound > adaptive_bound ? bound : adaptive_bound);
+    uint8_t * unpacked  = malloc(o.size);
+
+    struct samples samples[PHASES];
+    bool allocated = adaptive_bound != 0 && src != NULL && packed != NULL
+        && unpacked != NULL;
+
+    for (unsigned p = 0; p < PHASES; ++p) {
+        samples[p].ns   = malloc(o.runs * sizeof(uint64_t));
+        samples[p].size = 0;
+        allocated       = allocated && samples[p].ns != NULL;
+    }
+
+    if (!allocated) {
+        fprintf(stderr, "bench: not enough memory\n");
+        return 1;
+    }
+
+    if (o.csv)
+        printf("generator,kernel,phase,size,runs,ns_p50,ns_p90,"
+            "mbps_p50,mbps_p90,ratio\n");
+    else
+        printf("%-10s %-8s %-11s %12s %10s %10s %7s\n", "generator",
+            "kernel", "phase", "time p50", "MB/s p50", "MB/s p90", "ratio");
+
+    enum huffman_kernel selected = huffman_get_kernel();
+    bool found = false;
+    int status = 0;
+
+    /* Timings of a failed phase mean nothing, so benchmark stops.  */
+    bool failed = false;
+
+    for (size_t g = 0; !failed && g < GENERATORS; ++g) {
+        if (o.generator != NULL && strcmp(o.generator, generators[g].name))
+            continue;
+
+        uint64_t state = SEED;
+        generators[g].fill(src, o.size, &state);
+
+        size_t size = check_kernels(src, o.size, packed, unpacked, bound);
+        if (size == HUFFMAN_ERROR) {
+            fprintf(stderr, "bench: %s: kernels disagree\n",
+                generators[g].name);
+            status = 1;
+            continue;
+        }
+
+        double ratio = (double)size / o.size;
+
+        for (enum huffman_kernel k = 0; !failed && k < HUFFMAN_KERNELS;
+                ++k) {
+            char const * name = huffman_kernel_name(k);
+            if ((o.kernel != NULL && strcmp(o.kernel, name))
+                    || !huffman_set_kernel(k))
+                continue;
+
+            found = true;
+            size_t sizes[PHASES];
+            if (!run_phases(generators[g].name, src, o.size, packed,
+                    unpacked, adaptive_bound, &o, samples, sizes)) {
+                failed = true;
+                status = 1;
+                continue;
+            }
+
+            /* Phases of context and adaptive coding report their own
+             * ratio, the other ones that of huffman_compress_ctx.  */
+            double context_ratio = \
+                (double)sizes[PHASE_CONTEXT_COMPRESS] / o.size;
+            double adaptive_ratio = \
+                (double)sizes[PHASE_ADAPTIVE_ENCODE] / o.size;
+
+            for (enum phase p = 0; p < PHASES; ++p)
+                report(&o, generators[g].name, name, p, o.size, samples + p,
+                    p < PHASE_CONTEXT_COMPRESS ? ratio
+                    : p < PHASE_ADAPTIVE_ENCODE ? context_ratio
+                    : adaptive_ratio);
+        }
+    }
+
+    huffman_set_kernel(selected);
+
+    if (!found) {
+        fprintf(stderr, "bench: no such generator or kernel\n");
+        status = 2;
+    }
+
+    for (unsigned p = 0; p < PHASES; ++p)
+        free(samples[p].ns);
+
+    free(src);
+    free(packed);
+    free(unpacked);
+
+    return status;
+}
+
+
+void print_usage(FILE * f) {
+    fprintf(f,
+        "Usage: bench [-n SIZE] [-r N] [-w N] [-g NAME] [-k NAME] [-c]\n"
+        "Time phases of compression and decompression of generated inputs\n"
+        "with every kernel the processor supports.\n"
+        "\n"
+        "  -n SIZE  input size, with optional K or M suffix (default 8M)\n"
+        "  -r N     timed runs of every phase (default 10)\n"
+        "  -w N     untimed warmup runs (default 2)\n"
+        "  -g NAME  only generator NAME: uniform, zipf, single, english,\n"
+        "           json or records\n"
+        "  -k NAME  only kernel NAME: generic or bmi2\n"
+        "  -c       print CSV\n"
+        "  -h       show this help\n");
+}
+
+
+bool parse_size(char const * s, size_t * size) {
+    char * end;
+    unsigned long long value = strtoull(s, &end, 10);
+
+    /* Sign is not a digit.  */
+    if (end == s || *s < '0' || *s > '9')
+        return false;
+
+    uint8_t shift = 0;
+    if (*end == 'K' || *end == 'k')
+        shift = 10;
+
+    else if (*end == 'M' || *end == 'm')
+        shift = 20;
+
+    end += shift != 0;
+    if (*end != '\0' || value > UINT64_MAX >> shift
+            || value << shift > SIZE_MAX / 2)
+        return false;
+
+    *size = value << shift;
+
+    return true;
+}
+
+
+bool parse_count(char const * s, unsigned * count) {
+    char * end;
+    unsigned long long value = strtoull(s, &end, 10);
+
+    /* Sign is not a digit.  */
+    if (end == s || *s < '0' || *s > '9' || *end != '\0' || value > MAX_RUNS)
+        return false;
+
+    *count = value;
+
+    return true;
+}
+
+
+uint64_t next_random(uint64_t * state) {
+    /* xorshift64*  */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+
+uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+void fill_uniform(uint8_t * dst, size_t n, uint64_t * state) {
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = next_random(state) >> 56;
+}
+
+
+void fill_zipf(uint8_t * dst, size_t n, uint64_t * state) {
+    /* Cumulative distribution of ranks, scaled to 2^32.  */
+    double weights[256], sum = 0;
+    for (uint16_t j = 0; j < 256; ++j)
+        sum += weights[j] = pow(j + 1, -1.1);
+
+    uint64_t cdf[256];
+    double acc = 0;
+    for (uint16_t j = 0; j < 256; ++j) {
+        acc += weights[j];
+        cdf[j] = acc / sum * 4294967296.0;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t r = next_random(state) >> 32;
+
+        uint16_t lo = 0, hi = 255;
+        while (lo < hi) {
+            uint16_t mid = (lo + hi) / 2;
+            if (cdf[mid] > r)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+
+        /* Ranks are spread over byte values.  */
+        dst[i] = lo * 167 + 13;
+    }
+}
+
+
+void fill_single(uint8_t * dst, size_t n, uint64_t * state) {
+    (void)state;
+    memset(dst, 'a', n);
+}
+
+
+void fill_english(uint8_t * dst, size_t n, uint64_t * state) {
+    static char const * const words[] = {
+        "the", "of", "and", "to", "a", "in", "is", "it", "you", "that",
+        "he", "was", "for", "on", "are", "with", "as", "his", "they", "be",
+        "at", "one", "have", "this", "from", "or", "had", "by", "not",
+        "word", "but", "what", "some", "we", "can", "out", "other", "were",
+        "all", "there", "when", "up", "use", "your", "how", "said", "an",
+        "each", "she", "which", "do", "their", "time", "if", "will", "way",
+        "about", "many", "then", "them", "write", "would", "like", "so",
+        "these", "her", "long", "make", "thing", "see", "him", "two",
+        "has", "look", "more", "day", "could", "go", "come", "did",
+        "number", "sound", "no", "most", "people", "my", "over", "know",
+        "water", "than", "call", "first", "who", "may", "down", "side",
+        "been", "now", "find", "any", "new", "work", "part", "take", "get",
+        "place", "made", "live", "where", "after", "back", "little",
+        "only", "round", "man", "year", "came", "show", "every", "good",
+        "me", "give", "our", "under", "name", "very", "through", "just",
+        "form", "sentence", "great", "think", "say", "help", "low", "line",
+    };
+    size_t count = sizeof(words) / sizeof(words[0]);
+
+    size_t i = 0, in_sentence = 0;
+    while (i < n) {
+        /* Frequent words come first, squaring skews choice towards them.  */
+        uint64_t r = next_random(state) >> 40;
+        char const * word = words[(r * r >> 24) * count >> 24];
+
+        char buffer[32];
+        int length = snprintf(buffer, sizeof(buffer), "%s%s",
+            in_sentence == 0 ? "" : " ", word);
+
+        if (in_sentence == 0 && buffer[0] >= 'a')
+            buffer[0] -= 'a' - 'A';
+
+        if (++in_sentence > 6 + (next_random(state) >> 61)) {
+            length += snprintf(buffer + length, sizeof(buffer) - length,
+                next_random(state) >> 62 ? ". " : ",\n");
+            in_sentence = 0;
+        }
+
+        for (int k = 0; k < length && i < n; ++k)
+            dst[i++] = buffer[k];
+    }
+}
+
+
+void fill_json(uint8_t * dst, size_t n, uint64_t * state) {
+    static char const * const actions[] = {
+        "login", "logout", "view", "click", "purchase", "search"
+    };
+
+    size_t i = 0;
+    for (uint64_t id = 1; i < n; ++id) {
+        uint64_t r = next_random(state);
+
+        char buffer[256];
+        int length = snprintf(buffer, sizeof(buffer),
+            "{\"id\":%llu,\"user\":\"user%04llu\",\"action\":\"%s\","
+            "\"ts\":%llu,\"amount\":%llu.%02llu,\"ok\":%s}\n",
+            (unsigned long long)id, (unsigned long long)(r % 5000),
+            actions[(r >> 16) % 6],
+            (unsigned long long)(1700000000 + id * 3 + (r >> 60)),
+            (unsigned long long)((r >> 24) % 1000),
+            (unsigned long long)((r >> 40) % 100),
+            (r >> 63) ? "true" : "false");
+
+        for (int k = 0; k < length && i < n; ++k)
+            dst[i++] = buffer[k];
+    }
+}
+
+
+void fill_records(uint8_t * dst, size_t n, uint64_t * state) {
+    uint64_t timestamp = 1700000000000ull;
+
+    size_t i = 0;
+    for (uint32_t id = 1; i < n; ++id) {
+        uint64_t r = next_random(state);
+        timestamp += r % 1000;
+
+        float value = (float)(r >> 40) / 1000;
+        uint32_t bits;
+        memcpy(&bits, &value, 4);
+
+        uint8_t record[24];
+        for (uint8_t k = 0; k < 4; ++k)
+            record[k] = id >> (8 * k);
+        for (uint8_t k = 0; k < 8; ++k)
+            record[4 + k] = timestamp >> (8 * k);
+        for (uint8_t k = 0; k < 4; ++k)
+            record[12 + k] = (r >> 32 & 255) < 200 ? (k == 0 ? r % 7 : 0)
+                : r >> (8 * k);
+        for (uint8_t k = 0; k < 4; ++k)
+            record[16 + k] = bits >> (8 * k);
+        record[20] = r >> 50 & 3;
+        memset(record + 21, 0, 3);
+
+        for (uint8_t k = 0; k < sizeof(record) && i < n; ++k)
+            dst[i++] = record[k];
+    }
+}
+
+
+size_t check_kernels(uint8_t const * src, size_t n, uint8_t * packed,
+    uint8_t * unpacked, size_t bound)
+{
+    enum huffman_kernel selected = huffman_get_kernel();
+    uint8_t * reference = malloc(bound);
+    size_t size = HUFFMAN_ERROR;
+    bool same = reference != NULL;
+
+    for (enum huffman_kernel k = 0; same && k < HUFFMAN_KERNELS; ++k) {
+        if (!huffman_set_kernel(k))
+            continue;
+
+        size_t packed_size = huffman_compress(src, n, packed, bound);
+        if (packed_size == HUFFMAN_ERROR) {
+            same = false;
+            break;
+        }
+
+        if (size == HUFFMAN_ERROR) {
+            size = packed_size;
+            memcpy(reference, packed, size);
+        }
+
+        same = packed_size == size && memcmp(packed, reference, size) == 0
+            && huffman_decompress(packed, size, unpacked, n) == n
+            && memcmp(unpacked, src, n) == 0;
+    }
+
+    huffman_set_kernel(selected);
+    free(reference);
+
+    return same ? size : HUFFMAN_ERROR;
+}
+
+
+bool run_phases(char const * generator, uint8_t const * src, size_t n,
+    uint8_t * packed, uint8_t * unpacked, size_t bound,
+    struct options const * o, struct samples * samples, size_t * sizes)
+{
+    struct huffman_ctx * ctx = huffman_ctx_create();
+    struct huffman_ctx * context_ctx = huffman_ctx_create();
+    struct huffman_adaptive * encoder = huffman_adaptive_create();
+    struct huffman_adaptive * decoder = huffman_adaptive_create();
+    struct huffman_tree * tree = malloc(sizeof(struct huffman_tree));
+    struct _decode_table * decode_table = malloc(sizeof(struct _decode_table));
+
+    bool allocated = ctx != NULL && context_ctx != NULL && encoder != NULL
+        && decoder != NULL && tree != NULL && decode_table != NULL;
+    if (!allocated)
+        fprintf(stderr, "bench: not enough memory\n");
+    else
+        huffman_ctx_set_clusters(context_ctx, HUFFMAN_MAX_CLUSTERS);
+
+    uint64_t counts[256];
+    uint8_t lengths[256];
+    struct _encode_entry encode_table[256];
+
+    _count_frequencies(src, n, counts);
+    uint16_t symbols = 0;
+    for (uint16_t j = 0; j < 256; ++j)
+        symbols += counts[j] != 0;
+
+    bool coded = symbols > 1;
+
+    for (unsigned p = 0; p < PHASES; ++p)
+        samples[p].size = 0;
+
+    /* The first phase that failed, PHASES while none has.  */
+    enum phase failed = PHASES;
+
+    for (unsigned run = 0; allocated && failed == PHASES
+            && run < o->warmup + o->runs; ++run) {
+        uint64_t ns[PHASES] = { 0 };
+        uint64_t start = now_ns();
+
+        _count_frequencies(src, n, counts);
+        ns[PHASE_HISTOGRAM] = now_ns() - start;
+
+        if (coded) {
+            start = now_ns();
+            _build_huffman_tree(tree, counts);
+            _limit_code_lengths(tree, HUFFMAN_DEFAULT_MAX_CODE_LENGTH);
+            uint8_t max_length = _get_code_lengths(tree, lengths);
+            _build_encode_table(lengths, encode_table);
+            _build_decode_table(lengths, decode_table);
+            ns[PHASE_BUILD] = now_ns() - start;
+
+            uint8_t type = n < HUFFMAN_MIN_INTERLEAVED_SIZE
+                ? 0 : HUFFMAN_BLOCK_INTERLEAVED;
+
+            start = now_ns();
+            size_t size = _encode_streams(src, n, encode_table, max_length,
+                type, 0, packed, bound, NULL);
+            ns[PHASE_ENCODE] = now_ns() - start;
+
+            if (size == HUFFMAN_ERROR) {
+                failed = PHASE_ENCODE;
+                break;
+            }
+
+            start = now_ns();
+            bool decoded = _decode_streams(type, packed, size, unpacked, n,
+                decode_table, NULL);
+            ns[PHASE_DECODE] = now_ns() - start;
+
+            if (!decoded || memcmp(unpacked, src, n) != 0) {
+                failed = PHASE_DECODE;
+                break;
+            }
+        }
+
+        start = now_ns();
+        size_t size = huffman_compress_ctx(ctx, src, n, packed, bound);
+        ns[PHASE_COMPRESS] = now_ns() - start;
+        sizes[PHASE_COMPRESS] = size;
+
+        if (size == HUFFMAN_ERROR) {
+            failed = PHASE_COMPRESS;
+            break;
+        }
+
+        start = now_ns();
+        size_t unpacked_size = huffman_decompress_ctx(ctx, packed, size,
+            unpacked, n);
+        ns[PHASE_DECOMPRESS] = now_ns() - start;
+
+        if (unpacked_size != n || memcmp(unpacked, src, n) != 0) {
+            failed = PHASE_DECOMPRESS;
+            break;
+        }
+
+        start = now_ns();
+        size = huffman_compress_ctx(context_ctx, src, n, packed, bound);
+        ns[PHASE_CONTEXT_COMPRESS] = now_ns() - start;
+        sizes[PHASE_CONTEXT_COMPRESS] = size;
+
+        if (size == HUFFMAN_ERROR) {
+            failed = PHASE_CONTEXT_COMPRESS;
+            break;
+        }
+
+        start = now_ns();
+        unpacked_size = huffman_decompress_ctx(context_ctx, packed, size,
+            unpacked, n);
+        ns[PHASE_CONTEXT_DECOMPRESS] = now_ns() - start;
+
+        if (unpacked_size != n || memcmp(unpacked, src, n) != 0) {
+            failed = PHASE_CONTEXT_DECOMPRESS;
+            break;
+        }
+
+        /* Every run is a new stream, which starts with flat codes.  */
+        huffman_adaptive_reset(encoder);
+        huffman_adaptive_reset(decoder);
+
+        start = now_ns();
+        size = huffman_adaptive_encode(encoder, src, n, packed, bound);
+        ns[PHASE_ADAPTIVE_ENCODE] = now_ns() - start;
+        sizes[PHASE_ADAPTIVE_ENCODE] = size;
+
+        if (size == HUFFMAN_ERROR) {
+            failed = PHASE_ADAPTIVE_ENCODE;
+            break;
+        }
+
+        start = now_ns();
+        unpacked_size = huffman_adaptive_decode(decoder, packed, size,
+            unpacked, n);
+        ns[PHASE_ADAPTIVE_DECODE] = now_ns() - start;
+
+        if (unpacked_size != n || memcmp(unpacked, src, n) != 0) {
+            failed = PHASE_ADAPTIVE_DECODE;
+            break;
+        }
+
+        if (run < o->warmup)
+            continue;
+
+        for (unsigned p = 0; p < PHASES; ++p)
+            if (coded || p == PHASE_HISTOGRAM || p >= PHASE_COMPRESS)
+                samples[p].ns[samples[p].size++] = ns[p];
+    }
+
+    if (failed != PHASES)
+        fprintf(stderr, "bench: %s: %s with %s kernel failed\n", generator,
+            phase_names[failed], huffman_kernel_name(huffman_get_kernel()));
+
+    free(decode_table);
+    free(tree);
+    huffman_ctx_free(ctx);
+    huffman_ctx_free(context_ctx);
+    huffman_adaptive_free(encoder);
+    huffman_adaptive_free(decoder);
+
+    return allocated && failed == PHASES;
+}
+
+
+int compare_ns(void const * a, void const * b) {
+    uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
+
+
+uint64_t percentile(struct samples * s, unsigned percent) {
+    qsort(s->ns, s->size, sizeof(uint64_t), compare_ns);
+
+    unsigned i = (s->size * percent + 99) / 100;
+    return s->ns[i > 0 ? i - 1 : 0];
+}
+
+
+void report(struct options const * o, char const * generator,
+    char const * kernel, enum phase p, size_t n, struct samples * s,
+    double ratio)
+{
+    if (s->size == 0)
+        return;
+
+    /* Slower runs take more time, so 90th percentile of time is the 10th
+     * of throughput.  */
+    uint64_t p50 = percentile(s, 50), p90 = percentile(s, 90);
+    double mbps50 = p50 ? n / (p50 / 1e9) / 1e6 : 0;
+    double mbps90 = p90 ? n / (p90 / 1e9) / 1e6 : 0;
+
+    if (o->csv) {
+        printf("%s,%s,%s,%zu,%u,%llu,%llu,%.1f,%.1f,%.4f\n", generator,
+            kernel, phase_names[p], n, s->size, (unsigned long long)p50,
+            (unsigned long long)p90, mbps50, mbps90, ratio);
+        return;
+    }
+
+    printf("%-10s %-8s %-11s %10.3fms %10.1f %10.1f", generator, kernel,
+        phase_names[p], p50 / 1e6, mbps50, mbps90);
+
+    if (p == PHASE_COMPRESS || p == PHASE_CONTEXT_COMPRESS
+            || p == PHASE_ADAPTIVE_ENCODE)
+        printf(" %7.4f", ratio);
+
+    printf("\n");
+}
@@ -0,0 +1,1359 @@
+#include "./huf.h"
+
+
+/* Mapping of a region of file, which need not start at page boundary.  */
+struct _huf_map {
+    void *      base;       /* NULL if region is not mapped.  */
+    size_t      size;
+    uint8_t *   data;       /* Start of region within mapping.  */
+    size_t      length;     /* Of region.  */
+};
+
+
+/* Slot of one block in flight: raw input and its compressed data.  */
+struct _huf_block {
+    uint8_t const * raw;    /* Buffer of the slot or mapped input.  */
+    uint8_t *   buffer;     /* NULL if input is mapped.  */
+    uint8_t *   packed;     /* Size prefix followed by compressed data.  */
+    size_t      n, size;
+    bool        done;
+
+    struct _huf_compressor * compressor;
+};
+
+
+/* Offsets of one block, as stored in the index.  */
+struct _huf_index_entry {
+    uint64_t    offset;         /* Of its size prefix in the file.  */
+    uint64_t    raw_offset;     /* Of its data in uncompressed data.  */
+};
+
+
+/* Growing array of index entries.  */
+struct _huf_index {
+    struct _huf_index_entry *   entries;
+    uint64_t                    size, max_size;
+    struct huffman_stats *      stats;      /* Counts its allocations.  */
+};
+
+
+/* Reader thread reads blocks into free slots of the ring and hands them to
+ * workers, the writer writes the oldest block as soon as it is done and
+ * frees its slot.  */
+struct _huf_compressor {
+    struct pool *           pool;
+    struct huffman_ctx **   contexts;   /* One per worker.  */
+    unsigned                threads;
+
+    /* Of each worker followed by those of reader, or NULL if they are not
+     * collected.  */
+    struct huffman_stats *  stats;
+
+    struct _huf_block *     blocks;
+    unsigned                size;
+    size_t                  bound;
+    uint32_t                block_size;
+
+    struct _huf_index       index;
+    FILE *                  in;
+    struct _huf_map         input;
+    pthread_t               reader;
+
+    /* Blocks [next_write, next_read) are in flight. Reader stops at end of
+     * input, on error or when the writer stops it.  */
+    pthread_mutex_t         lock;
+    pthread_cond_t          done;       /* Block is read or done.  */
+    pthread_cond_t          room;       /* Slot is free or reader stopped.  */
+    uint64_t                next_read, next_write;
+    uint64_t                total;
+    bool                    eof, stop;
+    enum huf_status         status;     /* Of reader.  */
+};
+
+
+/* Blocks are decompressed in any order, each worker reads its block from
+ * file in and writes it at its final position in file out. When both files
+ * are mapped, blocks are decoded straight from one mapping into the other
+ * without buffers of workers.  */
+struct _huf_decompressor {
+    int                     in, out;
+    uint64_t                base;       /* Position of data in out.  */
+    uint32_t                block_size;
+    size_t                  bound;
+
+    struct _huf_index       index;
+    uint64_t                size;       /* Of file in.  */
+    uint64_t                end;        /* Offset of end of blocks.  */
+    uint64_t                total;
+
+    struct _huf_map         input, output;
+
+    struct pool *           pool;
+    struct huffman_ctx **   contexts;   /* One per worker.  */
+    uint8_t **              raw;
+    uint8_t **              packed;
+    unsigned                threads;
+    struct huffman_stats *  stats;      /* One per worker or NULL.  */
+
+    struct _huf_block_task * tasks;
+
+    /* First error of any worker, the rest of blocks are skipped.  */
+    pthread_mutex_t         lock;
+    enum huf_status         status;
+};
+
+
+struct _huf_block_task {
+    struct _huf_decompressor *  decompressor;
+    uint64_t                    block;
+};
+
+
+void
+huf_default_options(struct huf_options * options) {
+    options->block_size         = HUF_DEFAULT_BLOCK_SIZE;
+    options->max_code_length    = HUFFMAN_DEFAULT_MAX_CODE_LENGTH;
+    options->streams            = HUFFMAN_STREAMS;
+    options->clusters           = 0;
+    options->repeat             = false;
+    options->sync_interval      = 0;
+    options->adaptive_interval  = 0;
+    options->threads            = 1;
+    options->stats              = NULL;
+}
+
+
+enum huf_status
+huf_compress_file(FILE * in, FILE * out, struct huf_options const * options) {
+    uint32_t block_size = options->block_size;
+    if (block_size < HUF_MIN_BLOCK_SIZE || block_size > HUF_MAX_BLOCK_SIZE)
+        return HUF_ERROR_OPTIONS;
+
+    if (options->adaptive_interval != 0)
+        return _compress_adaptive(in, out, options);
+
+    /* Block which repeats table of the previous one must be compressed by
+     * the same context after it.  */
+    unsigned threads = options->repeat ? 1 : options->threads;
+    if (threads == 0)
+        threads = pool_default_threads();
+
+    struct _huf_compressor c;
+    enum huf_status status = _create_compressor(&c, options, threads, in);
+
+    struct huffman_stats * stats = options->stats;
+    HUFFMAN_STATS_START(stats, header_start);
+
+    if (status == HUF_OK)
+        status = _write_header(out, block_size,
+            options->repeat ? HUF_FLAG_REPEAT : 0, NULL);
+
+    HUFFMAN_STATS_TIME(stats, io_ns, header_start);
+
+    /* Input is read and blocks are compressed while done blocks are
+     * written, so that neither waits for the other. Reader waits for a
+     * free slot, so memory in use does not depend on speed of output.  */
+    bool reading = status == HUF_OK
+        && pthread_create(&c.reader, NULL, _read_blocks, &c) == 0;
+    if (status == HUF_OK && !reading)
+        status = HUF_ERROR_MEMORY;
+
+    uint64_t offset = HUF_HEADER_SIZE;
+
+    while (status == HUF_OK) {
+        struct _huf_block * b = NULL;
+
+        pthread_mutex_lock(&c.lock);
+        while (c.next_write == c.next_read && !c.eof)
+            pthread_cond_wait(&c.done, &c.lock);
+
+        if (c.next_write < c.next_read) {
+            b = c.blocks + c.next_write % c.size;
+            while (!b->done)
+                pthread_cond_wait(&c.done, &c.lock);
+        }
+        pthread_mutex_unlock(&c.lock);
+
+        if (b == NULL)
+            break;
+
+        HUFFMAN_STATS_START(stats, write_start);
+
+        if (b->size == HUFFMAN_ERROR
+                || !_index_push(&c.index, offset, c.next_write * block_size))
+            status = HUF_ERROR_MEMORY;
+
+        else if (fwrite(b->packed, 1, 4 + b->size, out) != 4 + b->size)
+            status = HUF_ERROR_WRITE;
+
+        HUFFMAN_STATS_TIME(stats, io_ns, write_start);
+        HUFFMAN_STATS_ADD(stats, bytes_out, 4);
+        offset += 4 + b->size;
+
+        pthread_mutex_lock(&c.lock);
+        ++c.next_write;
+        pthread_cond_signal(&c.room);
+        pthread_mutex_unlock(&c.lock);
+    }
+
+    if (reading) {
+        pthread_mutex_lock(&c.lock);
+        c.stop = true;
+        pthread_cond_signal(&c.room);
+        pthread_mutex_unlock(&c.lock);
+
+        pthread_join(c.reader, NULL);
+    }
+
+    if (status == HUF_OK)
+        status = c.status;
+
+    HUFFMAN_STATS_START(stats, footer_start);
+
+    if (status == HUF_OK)
+        status = _write_footer(out, &c.index, c.total);
+
+    if (status == HUF_OK && fflush(out) != 0)
+        status = HUF_ERROR_WRITE;
+
+    HUFFMAN_STATS_TIME(stats, io_ns, footer_start);
+    HUFFMAN_STATS_ADD(stats, bytes_out, HUF_HEADER_SIZE + 4
+        + c.index.size * HUF_INDEX_ENTRY_SIZE + HUF_TRAILER_SIZE);
+
+    /* Workers and reader are done.  */
+    for (unsigned i = 0; c.stats != NULL && i <= c.threads; ++i)
+        huffman_stats_add(stats, c.stats + i);
+
+    _free_compressor(&c);
+
+    return status;
+}
+
+
+enum huf_status
+huf_decompress_file(FILE * in, FILE * out, unsigned threads,
+    struct huffman_stats * stats)
+{
+    uint32_t block_size;
+    uint8_t flags, model[2];
+
+    HUFFMAN_STATS_START(stats, header_start);
+    enum huf_status status = _read_header(in, &block_size, &flags, model);
+    HUFFMAN_STATS_TIME(stats, io_ns, header_start);
+
+    if (status != HUF_OK)
+        return status;
+
+    if (threads == 0)
+        threads = pool_default_threads();
+
+    /* Blocks can be found through the index and written at their final
+     * positions only in regular files, others are written in order below.
+     * Blocks which may repeat tables of previous ones are decompressed by
+     * one worker in order, chunks of adaptive stream are decompressed one
+     * after another below.  */
+    bool adaptive = flags & HUF_FLAG_ADAPTIVE;
+    if (_is_regular_file(in) && _is_positional_output(out) && !adaptive)
+        return _decompress_blocks(in, out, block_size,
+            flags & HUF_FLAG_REPEAT ? 1 : threads, stats);
+
+    struct huffman_ctx * ctx = NULL;
+    struct huffman_adaptive * a = NULL;
+
+    /* Model out of range is a malformed header.  */
+    if (adaptive)
+        status = _create_adaptive(&a, model[0], model[1]);
+
+    else if ((ctx = huffman_ctx_create()) == NULL)
+        status = HUF_ERROR_MEMORY;
+
+    if (status == HUF_ERROR_OPTIONS)
+        status = HUF_ERROR_FORMAT;
+
+    size_t bound = a != NULL ? huffman_adaptive_bound(a, block_size)
+        : huffman_compress_bound(block_size);
+    uint8_t * raw       = malloc(block_size);
+    uint8_t * packed    = malloc(bound);
+
+    if (status == HUF_OK && (raw == NULL || packed == NULL))
+        status = HUF_ERROR_MEMORY;
+
+    else if (ctx != NULL)
+        huffman_ctx_set_stats(ctx, stats);
+
+    HUFFMAN_STATS_ADD(stats, allocations, 3);
+
+    /* Offsets of decoded blocks, the index must match them.  */
+    struct _huf_index index = { 0 };
+    index.stats = stats;
+    uint64_t total = 0, offset = HUF_HEADER_SIZE;
+
+    while (status == HUF_OK) {
+        HUFFMAN_STATS_START(stats, read_start);
+
+        uint8_t prefix[4];
+        if (_read_full(in, prefix, 4) != 4) {
+            status = ferror(in) ? HUF_ERROR_READ : HUF_ERROR_FORMAT;
+            break;
+        }
+
+        uint32_t size = _load_le32(prefix);
+
+        /* End of blocks, footer must match the blocks.  */
+        if (size == 0) {
+            status = _check_footer(in, &index, total);
+            break;
+        }
+
+        if (size > bound) {
+            status = HUF_ERROR_FORMAT;
+            break;
+        }
+
+        if (_read_full(in, packed, size) != size) {
+            status = ferror(in) ? HUF_ERROR_READ : HUF_ERROR_FORMAT;
+            break;
+        }
+
+        HUFFMAN_STATS_TIME(stats, io_ns, read_start);
+
+        size_t n = adaptive
+            ? huffman_adaptive_decode(a, packed, size, raw, block_size)
+            : huffman_decompress_ctx(ctx, packed, size, raw, block_size);
+        if (n == HUFFMAN_ERROR) {
+            status = HUF_ERROR_FORMAT;
+            break;
+        }
+
+        if (!_index_push(&index, offset, total)) {
+            status = HUF_ERROR_MEMORY;
+            break;
+        }
+
+        HUFFMAN_STATS_START(stats, write_start);
+
+        /* Chunk of live stream goes out at once.  */
+        if (fwrite(raw, 1, n, out) != n || (adaptive && fflush(out) != 0)) {
+            status = HUF_ERROR_WRITE;
+            break;
+        }
+
+        HUFFMAN_STATS_TIME(stats, io_ns, write_start);
+        offset  += 4 + size;
+        total   += n;
+    }
+
+    if (status == HUF_OK && fflush(out) != 0)
+        status = HUF_ERROR_WRITE;
+
+    HUFFMAN_STATS_ADD(stats, bytes_in, HUF_HEADER_SIZE + 4
+        + index.size * (HUF_INDEX_ENTRY_SIZE + 4) + HUF_TRAILER_SIZE);
+
+    free(raw);
+    free(packed);
+    free(index.entries);
+    huffman_ctx_free(ctx);
+    huffman_adaptive_free(a);
+
+    return status;
+}
+
+
+enum huf_status
+huf_decompress_range(FILE * in, FILE * out, uint64_t offset, uint64_t length,
+    struct huffman_stats * stats)
+{
+    if (!_is_regular_file(in))
+        return HUF_ERROR_SEEK;
+
+    struct _huf_decompressor d;
+    memset(&d, 0, sizeof(d));
+
+    uint8_t flags, model[2];
+
+    HUFFMAN_STATS_START(stats, index_start);
+    enum huf_status status = _read_header(in, &d.block_size, &flags, model);
+
+    /* Chunks of adaptive stream depend on all the previous ones.  */
+    if (status == HUF_OK && flags & HUF_FLAG_ADAPTIVE)
+        status = HUF_ERROR_SEEK;
+
+    d.in            = fileno(in);
+    d.bound         = huffman_compress_bound(d.block_size);
+    d.index.stats   = stats;
+
+    if (status == HUF_OK)
+        status = _read_index(&d);
+
+    HUFFMAN_STATS_TIME(stats, io_ns, index_start);
+
+    /* Slice is cut to the end of data.  */
+    if (offset > d.total)
+        offset = d.total;
+
+    if (length > d.total - offset)
+        length = d.total - offset;
+
+    if (status != HUF_OK || length == 0) {
+        free(d.index.entries);
+        return status;
+    }
+
+    struct huffman_ctx * ctx = huffman_ctx_create();
+    uint8_t * raw       = malloc(d.block_size);
+    uint8_t * packed    = malloc(4 + d.bound);
+
+    if (ctx == NULL || raw == NULL || packed == NULL)
+        status = HUF_ERROR_MEMORY;
+
+    HUFFMAN_STATS_ADD(stats, allocations, 3);
+
+    struct _huf_index_entry const * entries = d.index.entries;
+    uint64_t end    = offset + length;
+    uint64_t first  = offset / d.block_size;
+    uint64_t last   = (end - 1) / d.block_size;
+
+    /* Repeated code table comes from the nearest coded block before the
+     * slice, which is found by type of blocks at their beginnings.  */
+    uint64_t start = first;
+
+    while (status == HUF_OK && flags & HUF_FLAG_REPEAT && start > 0) {
+        uint8_t head[4 + HUFFMAN_MAX_VARINT_SIZE + 1];
+        uint64_t next = start + 1 < d.index.size
+            ? entries[start + 1].offset : d.end;
+        size_t n = next - entries[start].offset;
+        if (n > sizeof(head))
+            n = sizeof(head);
+
+        if (_pread_full(d.in, head, n, entries[start].offset) != n)
+            status = HUF_ERROR_READ;
+
+        else if (huffman_block_type(head + 4, n - 4) == HUFFMAN_BLOCK_CODED)
+            break;
+
+        else
+            --start;
+    }
+
+    for (uint64_t i = start; status == HUF_OK && i <= last; ++i) {
+        size_t size, expected;
+
+        HUFFMAN_STATS_START(stats, read_start);
+        status = _read_block(&d, i, packed, &size, &expected);
+        HUFFMAN_STATS_TIME(stats, io_ns, read_start);
+
+        if (status != HUF_OK)
+            break;
+
+        /* Blocks before the slice only provide code table.  */
+        uint64_t raw_offset = entries[i].raw_offset;
+        size_t from = 0, to = 0;
+
+        if (i >= first) {
+            from    = offset > raw_offset ? offset - raw_offset : 0;
+            to      = end - raw_offset < expected ? end - raw_offset : expected;
+        }
+
+        HUFFMAN_STATS_START(stats, decode_start);
+
+        if (huffman_decompress_range_ctx(ctx, packed + 4, size, from,
+                to - from, raw) != to - from) {
+            status = HUF_ERROR_FORMAT;
+            break;
+        }
+
+        HUFFMAN_STATS_TIME(stats, decode_ns, decode_start);
+        HUFFMAN_STATS_ADD(stats, bytes_in, 4 + size);
+        HUFFMAN_STATS_ADD(stats, bytes_out, to - from);
+        HUFFMAN_STATS_START(stats, write_start);
+
+        if (fwrite(raw, 1, to - from, out) != to - from)
+            status = HUF_ERROR_WRITE;
+
+        HUFFMAN_STATS_TIME(stats, io_ns, write_start);
+    }
+
+    if (status == HUF_OK && fflush(out) != 0)
+        status = HUF_ERROR_WRITE;
+
+    free(raw);
+    free(packed);
+    free(d.index.entries);
+    huffman_ctx_free(ctx);
+
+    return status;
+}
+
+
+char const *
+huf_status_string(enum huf_status status) {
+    switch (status) {
+        case HUF_OK:            return "success";
+        case HUF_ERROR_READ:    return "can not read input";
+        case HUF_ERROR_WRITE:   return "can not write output";
+        case HUF_ERROR_FORMAT:  return "input is not a valid .huf file";
+        case HUF_ERROR_MEMORY:  return "not enough memory";
+        case HUF_ERROR_OPTIONS: return "options are out of range";
+        case HUF_ERROR_SEEK:    return "input does not allow random access";
+    }
+
+    return "unknown error";
+}
+
+
+static void
+_store_le32(uint8_t * p, uint32_t value) {
+    for (uint8_t i = 0; i < 4; ++i)
+        p[i] = value >> (8 * i);
+}
+
+
+static void
+_store_le64(uint8_t * p, uint64_t value) {
+    for (uint8_t i = 0; i < 8; ++i)
+        p[i] = value >> (8 * i);
+}
+
+
+static uint32_t
+_load_le32(uint8_t const * p) {
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < 4; ++i)
+        value |= (uint32_t)p[i] << (8 * i);
+
+    return value;
+}
+
+
+static uint64_t
+_load_le64(uint8_t const * p) {
+    uint64_t value = 0;
+    for (uint8_t i = 0; i < 8; ++i)
+        value |= (uint64_t)p[i] << (8 * i);
+
+    return value;
+}
+
+
+static size_t
+_read_full(FILE * in, void * buffer, size_t n) {
+    size_t size = 0;
+
+    /* Pipes may return less than asked before the end.  */
+    while (size < n) {
+        size_t read = fread((uint8_t *)buffer + size, 1, n - size, in);
+        if (read == 0)
+            break;
+
+        size += read;
+    }
+
+    return size;
+}
+
+
+static enum huf_status
+_create_compressor(struct _huf_compressor * c,
+    struct huf_options const * options, unsigned threads, FILE * in)
+{
+    memset(c, 0, sizeof(*c));
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->done, NULL);
+    pthread_cond_init(&c->room, NULL);
+
+    /* There are twice as many slots as workers, so that workers have the
+     * next blocks at hand while the oldest one is written, and one more for
+     * the reader to fill.  */
+    c->threads      = threads;
+    c->size         = 2 * threads + 1;
+    c->bound        = huffman_compress_bound(options->block_size);
+    c->block_size   = options->block_size;
+    c->in           = in;
+    c->contexts = calloc(threads, sizeof(struct huffman_ctx *));
+    c->blocks   = calloc(c->size, sizeof(struct _huf_block));
+
+    if (c->contexts == NULL || c->blocks == NULL)
+        return HUF_ERROR_MEMORY;
+
+    struct huffman_stats * stats = options->stats;
+    c->index.stats = stats;
+
+    if (stats != NULL) {
+        c->stats = calloc(threads + 1, sizeof(struct huffman_stats));
+        if (c->stats == NULL)
+            return HUF_ERROR_MEMORY;
+    }
+
+    for (unsigned i = 0; i < threads; ++i) {
+        c->contexts[i] = huffman_ctx_create();
+        if (c->contexts[i] == NULL)
+            return HUF_ERROR_MEMORY;
+
+        if (!huffman_ctx_set_max_code_length(c->contexts[i],
+                options->max_code_length)
+                || !huffman_ctx_set_streams(c->contexts[i], options->streams)
+                || !huffman_ctx_set_clusters(c->contexts[i], options->clusters)
+                || !huffman_ctx_set_sync_interval(c->contexts[i],
+                    options->sync_interval))
+            return HUF_ERROR_OPTIONS;
+
+        huffman_ctx_set_repeat(c->contexts[i], options->repeat);
+
+        if (stats != NULL)
+            huffman_ctx_set_stats(c->contexts[i], c->stats + i);
+    }
+
+    /* The rest of regular file is mapped, so that it is not copied into
+     * buffers of slots. Empty rest can not be mapped and is read.  */
+    struct stat st;
+    off_t start;
+    if (_is_regular_file(in) && fstat(fileno(in), &st) == 0
+            && (start = ftello(in)) >= 0 && st.st_size > start
+            && _map_file(&c->input, fileno(in), start, st.st_size - start,
+                false))
+        madvise(c->input.base, c->input.size, MADV_SEQUENTIAL);
+
+    for (unsigned i = 0; i < c->size; ++i) {
+        struct _huf_block * b = c->blocks + i;
+        b->compressor   = c;
+        b->packed       = malloc(4 + c->bound);
+
+        if (c->input.data == NULL)
+            b->raw = b->buffer = malloc(options->block_size);
+
+        if (b->packed == NULL || (c->input.data == NULL && b->buffer == NULL))
+            return HUF_ERROR_MEMORY;
+    }
+
+    if ((c->pool = pool_create(threads)) == NULL)
+        return HUF_ERROR_MEMORY;
+
+    /* Arrays, contexts, buffers of slots and pool.  */
+    HUFFMAN_STATS_ADD(stats, allocations, 2 + (stats != NULL) + threads
+        + c->size * (c->input.data != NULL ? 1 : 2) + 1);
+
+    return HUF_OK;
+}
+
+
+static void
+_free_compressor(struct _huf_compressor * c) {
+    /* Blocks still in flight are finished before their memory is freed.  */
+    if (c->pool != NULL)
+        pool_free(c->pool);
+
+    for (unsigned i = 0; c->contexts != NULL && i < c->threads; ++i)
+        huffman_ctx_free(c->contexts[i]);
+
+    for (unsigned i = 0; c->blocks != NULL && i < c->size; ++i) {
+        free(c->blocks[i].buffer);
+        free(c->blocks[i].packed);
+    }
+
+    free(c->contexts);
+    free(c->stats);
+    free(c->blocks);
+    free(c->index.entries);
+    _unmap_file(&c->input);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->done);
+    pthread_cond_destroy(&c->room);
+}
+
+
+static void *
+_read_blocks(void * arg) {
+    struct _huf_compressor * c = arg;
+    uint64_t total = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&c->lock);
+        while (c->next_read - c->next_write == c->size && !c->stop)
+            pthread_cond_wait(&c->room, &c->lock);
+
+        bool stop = c->stop;
+        struct _huf_block * b = c->blocks + c->next_read % c->size;
+        pthread_mutex_unlock(&c->lock);
+
+        if (stop)
+            break;
+
+        /* Blocks of mapped input are compressed where they are.  */
+        enum huf_status status = HUF_OK;
+        size_t n = c->block_size;
+
+        if (c->input.data != NULL) {
+            if (n > c->input.length - total)
+                n = c->input.length - total;
+
+            b->raw = c->input.data + total;
+        }
+
+        else {
+            /* Reader has the slot after those of workers.  */
+            struct huffman_stats * stats = c->stats != NULL
+                ? c->stats + c->threads : NULL;
+            (void)stats;    /* Unused without HUFFMAN_STATS.  */
+            HUFFMAN_STATS_START(stats, read_start);
+
+            n = _read_full(c->in, b->buffer, c->block_size);
+            if (ferror(c->in))
+                status = HUF_ERROR_READ;
+
+            HUFFMAN_STATS_TIME(stats, io_ns, read_start);
+        }
+
+        if (n > 0 && status == HUF_OK) {
+            b->n    = n;
+            b->done = false;
+
+            if (!pool_submit(c->pool, _compress_block, b))
+                status = HUF_ERROR_MEMORY;
+        }
+
+        total += n;
+
+        pthread_mutex_lock(&c->lock);
+        if (n > 0 && status == HUF_OK) {
+            ++c->next_read;
+            c->total = total;
+        }
+
+        if (n < c->block_size || status != HUF_OK)
+            c->eof = true;
+
+        if (c->status == HUF_OK)
+            c->status = status;
+
+        bool eof = c->eof;
+        pthread_cond_broadcast(&c->done);
+        pthread_mutex_unlock(&c->lock);
+
+        if (eof)
+            break;
+    }
+
+    return NULL;
+}
+
+
+static void
+_compress_block(void * arg, unsigned worker) {
+    struct _huf_block * b = arg;
+    struct _huf_compressor * c = b->compressor;
+
+    /* Output always fits, so failure is lack of memory for context codes,
+     * which the writer reports instead of the block.  */
+    b->size = huffman_compress_ctx(c->contexts[worker], b->raw, b->n,
+        b->packed + 4, c->bound);
+    if (b->size != HUFFMAN_ERROR)
+        _store_le32(b->packed, b->size);
+
+    pthread_mutex_lock(&c->lock);
+    b->done = true;
+    pthread_cond_broadcast(&c->done);
+    pthread_mutex_unlock(&c->lock);
+}
+
+
+static enum huf_status
+_compress_adaptive(FILE * in, FILE * out, struct huf_options const * options)
+{
+    uint32_t interval = options->adaptive_interval;
+    uint8_t model[2] = { options->max_code_length, 0 };
+    while (model[1] < 31 && (uint32_t)1 << model[1] < interval)
+        ++model[1];
+
+    if ((uint32_t)1 << model[1] != interval)
+        return HUF_ERROR_OPTIONS;
+
+    struct huffman_stats * stats = options->stats;
+    uint32_t block_size = options->block_size;
+
+    struct huffman_adaptive * a;
+    enum huf_status status = _create_adaptive(&a, model[0], model[1]);
+
+    size_t bound = a != NULL ? huffman_adaptive_bound(a, block_size) : 0;
+    uint8_t * raw       = malloc(block_size);
+    uint8_t * packed    = malloc(4 + bound);
+
+    if (status == HUF_OK && (raw == NULL || packed == NULL))
+        status = HUF_ERROR_MEMORY;
+
+    HUFFMAN_STATS_ADD(stats, allocations, 3);
+
+    if (status == HUF_OK)
+        status = _write_header(out, block_size, HUF_FLAG_ADAPTIVE, model);
+
+    struct _huf_index index = { 0 };
+    index.stats = stats;
+    uint64_t total = 0, offset = HUF_HEADER_SIZE;
+
+    while (status == HUF_OK) {
+        /* Whatever input is there is coded at once, without waiting for the
+         * rest of block.  */
+        HUFFMAN_STATS_START(stats, read_start);
+        ssize_t n = read(fileno(in), raw, block_size);
+        HUFFMAN_STATS_TIME(stats, io_ns, read_start);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0)
+            status = HUF_ERROR_READ;
+
+        if (n <= 0)
+            break;
+
+        HUFFMAN_STATS_START(stats, encode_start);
+        size_t size = huffman_adaptive_encode(a, raw, n, packed + 4, bound);
+        HUFFMAN_STATS_TIME(stats, encode_ns, encode_start);
+        HUFFMAN_STATS_ADD(stats, bytes_in, n);
+
+        /* Chunk always fits its bound, a failed one is not written with a
+         * bogus size prefix all the same.  */
+        if (size == HUFFMAN_ERROR) {
+            status = HUF_ERROR_WRITE;
+            break;
+        }
+
+        _store_le32(packed, size);
+
+        if (!_index_push(&index, offset, total)) {
+            status = HUF_ERROR_MEMORY;
+            break;
+        }
+
+        HUFFMAN_STATS_START(stats, write_start);
+
+        if (fwrite(packed, 1, 4 + size, out) != 4 + size || fflush(out) != 0)
+            status = HUF_ERROR_WRITE;
+
+        HUFFMAN_STATS_TIME(stats, io_ns, write_start);
+        HUFFMAN_STATS_ADD(stats, bytes_out, 4 + size);
+        offset  += 4 + size;
+        total   += n;
+    }
+
+    if (status == HUF_OK)
+        status = _write_footer(out, &index, total);
+
+    if (status == HUF_OK && fflush(out) != 0)
+        status = HUF_ERROR_WRITE;
+
+    HUFFMAN_STATS_ADD(stats, bytes_out, HUF_HEADER_SIZE + 4
+        + index.size * HUF_INDEX_ENTRY_SIZE + HUF_TRAILER_SIZE);
+
+    free(raw);
+    free(packed);
+    free(index.entries);
+    huffman_adaptive_free(a);
+
+    return status;
+}
+
+
+static enum huf_status
+_create_adaptive(struct huffman_adaptive ** a, uint8_t max_code_length,
+    uint8_t interval_bits)
+{
+    if ((*a = huffman_adaptive_create()) == NULL)
+        return HUF_ERROR_MEMORY;
+
+    if (interval_bits >= 8 * sizeof(size_t)
+            || !huffman_adaptive_set_interval(*a, (size_t)1 << interval_bits)
+            || !huffman_adaptive_set_max_code_length(*a, max_code_length))
+        return HUF_ERROR_OPTIONS;
+
+    return HUF_OK;
+}
+
+
+static bool
+_index_push(struct _huf_index * index, uint64_t offset, uint64_t raw_offset) {
+    if (index->size == index->max_size) {
+        uint64_t max_size = index->max_size ? 2 * index->max_size : 64;
+        struct _huf_index_entry * entries = \
+            realloc(index->entries, max_size * sizeof(struct _huf_index_entry));
+        if (entries == NULL)
+            return false;
+
+        index->entries  = entries;
+        index->max_size = max_size;
+        HUFFMAN_STATS_ADD(index->stats, allocations, 1);
+    }
+
+    index->entries[index->size++] = \
+        (struct _huf_index_entry){ offset, raw_offset };
+
+    return true;
+}
+
+
+static enum huf_status
+_write_footer(FILE * out, struct _huf_index const * index, uint64_t total) {
+    uint8_t buffer[HUF_INDEX_ENTRY_SIZE];
+
+    _store_le32(buffer, 0);
+    if (fwrite(buffer, 1, 4, out) != 4)
+        return HUF_ERROR_WRITE;
+
+    for (uint64_t i = 0; i < index->size; ++i) {
+        _store_le64(buffer, index->entries[i].offset);
+        _store_le64(buffer + 8, index->entries[i].raw_offset);
+
+        if (fwrite(buffer, 1, HUF_INDEX_ENTRY_SIZE, out) != HUF_INDEX_ENTRY_SIZE)
+            return HUF_ERROR_WRITE;
+    }
+
+    _store_le64(buffer, index->size);
+    _store_le64(buffer + 8, total);
+
+    if (fwrite(buffer, 1, HUF_TRAILER_SIZE, out) != HUF_TRAILER_SIZE)
+        return HUF_ERROR_WRITE;
+
+    return HUF_OK;
+}
+
+
+static enum huf_status
+_check_footer(FILE * in, struct _huf_index const * index, uint64_t total) {
+    uint8_t buffer[HUF_INDEX_ENTRY_SIZE];
+
+    for (uint64_t i = 0; i <= index->size; ++i) {
+        if (_read_full(in, buffer, HUF_INDEX_ENTRY_SIZE) != HUF_INDEX_ENTRY_SIZE)
+            return ferror(in) ? HUF_ERROR_READ : HUF_ERROR_FORMAT;
+
+        /* Index is followed by trailer.  */
+        bool match = i < index->size
+            ? _load_le64(buffer) == index->entries[i].offset
+                && _load_le64(buffer + 8) == index->entries[i].raw_offset
+            : _load_le64(buffer) == index->size
+                && _load_le64(buffer + 8) == total;
+
+        if (!match)
+            return HUF_ERROR_FORMAT;
+    }
+
+    return HUF_OK;
+}
+
+
+static enum huf_status
+_read_index(struct _huf_decompressor * d) {
+    struct stat st;
+    if (fstat(d->in, &st) != 0)
+        return HUF_ERROR_READ;
+
+    uint64_t size = d->size = st.st_size;
+    if (size < HUF_HEADER_SIZE + 4 + HUF_TRAILER_SIZE)
+        return HUF_ERROR_FORMAT;
+
+    uint8_t buffer[HUF_INDEX_ENTRY_SIZE];
+    if (_pread_full(d->in, buffer, HUF_TRAILER_SIZE, size - HUF_TRAILER_SIZE)
+            != HUF_TRAILER_SIZE)
+        return HUF_ERROR_READ;
+
+    /* Every block takes at least its size prefix and index entry.  */
+    uint64_t count  = _load_le64(buffer);
+    d->total        = _load_le64(buffer + 8);
+
+    uint64_t room = size - HUF_HEADER_SIZE - 4 - HUF_TRAILER_SIZE;
+    if (count > room / (4 + HUF_INDEX_ENTRY_SIZE))
+        return HUF_ERROR_FORMAT;
+
+    d->end = size - HUF_TRAILER_SIZE - count * HUF_INDEX_ENTRY_SIZE - 4;
+
+    if (_pread_full(d->in, buffer, 4, d->end) != 4)
+        return HUF_ERROR_READ;
+
+    if (_load_le32(buffer) != 0)
+        return HUF_ERROR_FORMAT;
+
+    /* Index is read in chunks of entries.  */
+    uint8_t chunk[256 * HUF_INDEX_ENTRY_SIZE];
+
+    for (uint64_t i = 0; i < count; i += 256) {
+        size_t n = (count - i < 256 ? count - i : 256) * HUF_INDEX_ENTRY_SIZE;
+        if (_pread_full(d->in, chunk, n, d->end + 4 + i * HUF_INDEX_ENTRY_SIZE)
+                != n)
+            return HUF_ERROR_READ;
+
+        for (size_t j = 0; j < n; j += HUF_INDEX_ENTRY_SIZE)
+            if (!_index_push(&d->index, _load_le64(chunk + j),
+                    _load_le64(chunk + j + 8)))
+                return HUF_ERROR_MEMORY;
+    }
+
+    /* Blocks follow each other from the header up to the end marker, and
+     * all but the last one hold exactly block size bytes.  */
+    struct _huf_index_entry const * entries = d->index.entries;
+
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t offset = entries[i].offset;
+        uint64_t end    = i + 1 < count ? entries[i + 1].offset : d->end;
+
+        if ((i == 0 && offset != HUF_HEADER_SIZE)
+                || end <= offset + 4 || end - offset - 4 > d->bound
+                || entries[i].raw_offset != i * d->block_size)
+            return HUF_ERROR_FORMAT;
+    }
+
+    if (count == 0 ? d->end != HUF_HEADER_SIZE || d->total != 0
+            : d->total <= (count - 1) * d->block_size
+                || d->total > count * d->block_size)
+        return HUF_ERROR_FORMAT;
+
+    return HUF_OK;
+}
+
+
+static enum huf_status
+_read_block(struct _huf_decompressor * d, uint64_t block, uint8_t * packed,
+    size_t * size, size_t * expected)
+{
+    /* Index is checked, so sizes are in bounds.  */
+    struct _huf_index_entry const * entry = d->index.entries + block;
+    uint64_t end = block + 1 < d->index.size ? entry[1].offset : d->end;
+    size_t n = end - entry->offset;
+
+    *expected = d->total - entry->raw_offset;
+    if (*expected > d->block_size)
+        *expected = d->block_size;
+
+    if (_pread_full(d->in, packed, n, entry->offset) != n)
+        return HUF_ERROR_READ;
+
+    if (_load_le32(packed) != n - 4
+            || huffman_decompressed_size(packed + 4, n - 4) != *expected)
+        return HUF_ERROR_FORMAT;
+
+    *size = n - 4;
+
+    return HUF_OK;
+}
+
+
+static enum huf_status
+_decompress_blocks(FILE * in, FILE * out, uint32_t block_size,
+    unsigned threads, struct huffman_stats * stats)
+{
+    struct _huf_decompressor d;
+    memset(&d, 0, sizeof(d));
+    pthread_mutex_init(&d.lock, NULL);
+
+    d.in            = fileno(in);
+    d.out           = fileno(out);
+    d.block_size    = block_size;
+    d.bound         = huffman_compress_bound(block_size);
+    d.threads       = threads;
+    d.index.stats   = stats;
+
+    HUFFMAN_STATS_START(stats, index_start);
+    enum huf_status status = _read_index(&d);
+    HUFFMAN_STATS_TIME(stats, io_ns, index_start);
+
+    /* Reserve output, so that blocks can be written in any order.  */
+    if (status == HUF_OK) {
+        off_t base = fflush(out) == 0 ? ftello(out) : -1;
+
+        if (base < 0 || ftruncate(d.out, base + d.total) != 0)
+            status = HUF_ERROR_WRITE;
+
+        d.base = base;
+    }
+
+    /* Output is mapped only along with input. Output opened for writing
+     * only can not be mapped, its blocks are then written from buffers.  */
+    if (status == HUF_OK && d.total > 0
+            && _map_file(&d.input, d.in, 0, d.size, false)
+            && !_map_file(&d.output, d.out, d.base, d.total, true))
+        _unmap_file(&d.input);
+
+    if (d.input.data != NULL)
+        madvise(d.input.base, d.input.size, MADV_SEQUENTIAL);
+
+    if (status == HUF_OK) {
+        d.contexts  = calloc(threads, sizeof(struct huffman_ctx *));
+        d.raw       = calloc(threads, sizeof(uint8_t *));
+        d.packed    = calloc(threads, sizeof(uint8_t *));
+        d.tasks     = calloc(d.index.size, sizeof(struct _huf_block_task));
+
+        if (stats != NULL)
+            d.stats = calloc(threads, sizeof(struct huffman_stats));
+
+        if (d.contexts == NULL || d.raw == NULL || d.packed == NULL
+                || (d.tasks == NULL && d.index.size > 0)
+                || (d.stats == NULL && stats != NULL))
+            status = HUF_ERROR_MEMORY;
+    }
+
+    for (unsigned i = 0; status == HUF_OK && i < threads; ++i) {
+        d.contexts[i] = huffman_ctx_create();
+        if (d.contexts[i] == NULL)
+            status = HUF_ERROR_MEMORY;
+
+        else if (stats != NULL)
+            huffman_ctx_set_stats(d.contexts[i], d.stats + i);
+
+        if (d.output.data == NULL) {
+            d.raw[i]    = malloc(block_size);
+            d.packed[i] = malloc(4 + d.bound);
+
+            if (d.raw[i] == NULL || d.packed[i] == NULL)
+                status = HUF_ERROR_MEMORY;
+        }
+    }
+
+    if (status == HUF_OK && (d.pool = pool_create(threads)) == NULL)
+        status = HUF_ERROR_MEMORY;
+
+    /* Arrays, contexts, buffers of workers and pool.  */
+    HUFFMAN_STATS_ADD(stats, allocations, 4 + (stats != NULL) + threads
+        + (d.output.data == NULL ? 2 * threads : 0) + 1);
+
+    for (uint64_t i = 0; status == HUF_OK && i < d.index.size; ++i) {
+        d.tasks[i] = (struct _huf_block_task){ &d, i };
+
+        if (!pool_submit(d.pool, _decompress_block, d.tasks + i))
+            status = HUF_ERROR_MEMORY;
+    }
+
+    /* Wait for all blocks.  */
+    if (d.pool != NULL)
+        pool_free(d.pool);
+
+    if (status == HUF_OK)
+        status = d.status;
+
+    if (status == HUF_OK && fseeko(out, d.base + d.total, SEEK_SET) != 0)
+        status = HUF_ERROR_WRITE;
+
+    /* Workers are done.  */
+    for (unsigned i = 0; d.stats != NULL && i < threads; ++i)
+        huffman_stats_add(stats, d.stats + i);
+
+    HUFFMAN_STATS_ADD(stats, bytes_in, HUF_HEADER_SIZE + 4
+        + d.index.size * (HUF_INDEX_ENTRY_SIZE + 4) + HUF_TRAILER_SIZE);
+
+    for (unsigned i = 0; d.contexts != NULL && i < threads; ++i) {
+        huffman_ctx_free(d.contexts[i]);
+        free(d.raw[i]);
+        free(d.packed[i]);
+    }
+
+    free(d.contexts);
+    free(d.raw);
+    free(d.packed);
+    free(d.stats);
+    free(d.tasks);
+    free(d.index.entries);
+    _unmap_file(&d.input);
+    _unmap_file(&d.output);
+    pthread_mutex_destroy(&d.lock);
+
+    return status;
+}
+
+
+static void
+_decompress_block(void * arg, unsigned worker) {
+    struct _huf_block_task * task = arg;
+    struct _huf_decompressor * d = task->decompressor;
+
+    pthread_mutex_lock(&d->lock);
+    enum huf_status status = d->status;
+    pthread_mutex_unlock(&d->lock);
+
+    if (status != HUF_OK)
+        return;
+
+    /* Index is checked, so sizes are in bounds.  */
+    struct _huf_index_entry const * entry = d->index.entries + task->block;
+    uint64_t end = task->block + 1 < d->index.size ? entry[1].offset : d->end;
+    size_t size = end - entry->offset;
+
+    size_t expected = d->total - entry->raw_offset;
+    if (expected > d->block_size)
+        expected = d->block_size;
+
+    bool mapped = d->output.data != NULL;
+    uint8_t const * packed = mapped
+        ? d->input.data + entry->offset : d->packed[worker];
+    uint8_t * raw = mapped
+        ? d->output.data + entry->raw_offset : d->raw[worker];
+
+    struct huffman_stats * stats = d->stats != NULL ? d->stats + worker : NULL;
+    (void)stats;    /* Unused without HUFFMAN_STATS.  */
+
+    HUFFMAN_STATS_START(stats, read_start);
+    bool read = mapped
+        || _pread_full(d->in, d->packed[worker], size, entry->offset) == size;
+    HUFFMAN_STATS_TIME(stats, io_ns, read_start);
+
+    if (!read)
+        status = HUF_ERROR_READ;
+
+    /* Size of block is known from the index, so it is checked before
+     * decoding and the decoder gets exactly that much room.  */
+    else if (_load_le32(packed) != size - 4
+            || huffman_decompressed_size(packed + 4, size - 4) != expected
+            || huffman_decompress_ctx(d->contexts[worker], packed + 4,
+                size - 4, raw, expected) != expected)
+        status = HUF_ERROR_FORMAT;
+
+    else if (!mapped) {
+        HUFFMAN_STATS_START(stats, write_start);
+
+        if (_pwrite_full(d->out, raw, expected, d->base + entry->raw_offset)
+                != expected)
+            status = HUF_ERROR_WRITE;
+
+        HUFFMAN_STATS_TIME(stats, io_ns, write_start);
+    }
+
+    if (status != HUF_OK) {
+        pthread_mutex_lock(&d->lock);
+        if (d->status == HUF_OK)
+            d->status = status;
+        pthread_mutex_unlock(&d->lock);
+    }
+}
+
+
+static bool
+_is_regular_file(FILE * f) {
+    struct stat st;
+    return fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+
+static bool
+_is_positional_output(FILE * f) {
+    struct stat st;
+    int flags = fcntl(fileno(f), F_GETFL);
+    off_t position = fflush(f) == 0 ? ftello(f) : -1;
+
+    return flags != -1 && !(flags & O_APPEND) && position >= 0
+        && fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)
+        && st.st_size <= position;
+}
+
+
+static bool
+_map_file(struct _huf_map * map, int fd, uint64_t offset, uint64_t n,
+    bool writable)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t start = page > 0 ? offset - offset % page : offset;
+
+    map->base = NULL;
+    map->data = NULL;
+
+    if (n == 0 || offset - start + n > SIZE_MAX)
+        return false;
+
+    map->size = offset - start + n;
+    void * base = mmap(NULL, map->size,
+        writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, start);
+    if (base == MAP_FAILED)
+        return false;
+
+    map->base   = base;
+    map->data   = (uint8_t *)base + (offset - start);
+    map->length = n;
+
+    return true;
+}
+
+
+static void
+_unmap_file(struct _huf_map * map) {
+    if (map->base != NULL)
+        munmap(map->base, map->size);
+
+    map->base = NULL;
+    map->data = NULL;
+}
+
+
+static size_t
+_pread_full(int fd, void * buffer, size_t n, uint64_t offset) {
+    size_t size = 0;
+
+    while (size < n) {
+        ssize_t read = pread(fd, (uint8_t *)buffer + size, n - size,
+            offset + size);
+        if (read <= 0)
+            break;
+
+        size += read;
+    }
+
+    return size;
+}
+
+
+static size_t
+_pwrite_full(int fd, void const * buffer, size_t n, uint64_t offset) {
+    size_t size = 0;
+
+    while (size < n) {
+        ssize_t written = pwrite(fd, (uint8_t const *)buffer + size, n - size,
+            offset + size);
+        if (written <= 0)
+            break;
+
+        size += written;
+    }
+
+    return size;
+}
+
+
+static enum huf_status
+_write_header(FILE * out, uint32_t block_size, uint8_t flags,
+    uint8_t const * model)
+{
+    uint8_t header[HUF_HEADER_SIZE] = { 0 };
+    memcpy(header, HUF_MAGIC, 4);
+    header[4] = HUF_VERSION;
+    header[5] = flags;
+    _store_le32(header + 8, block_size);
+
+    if (model != NULL)
+        memcpy(header + 6, model, 2);
+
+    if (fwrite(header, 1, HUF_HEADER_SIZE, out) != HUF_HEADER_SIZE)
+        return HUF_ERROR_WRITE;
+
+    return HUF_OK;
+}
+
+
+static enum huf_status
+_read_header(FILE * in, uint32_t * block_size, uint8_t * flags,
+    uint8_t * model)
+{
+    uint8_t header[HUF_HEADER_SIZE];
+    if (_read_full(in, header, HUF_HEADER_SIZE) != HUF_HEADER_SIZE)
+        return ferror(in) ? HUF_ERROR_READ : HUF_ERROR_FORMAT;
+
+    if (memcmp(header, HUF_MAGIC, 4) != 0 || header[4] != HUF_VERSION)
+        return HUF_ERROR_FORMAT;
+
+    *flags = header[5];
+    if (*flags & ~(HUF_FLAG_REPEAT | HUF_FLAG_ADAPTIVE))
+        return HUF_ERROR_FORMAT;
+
+    /* Model is checked by the adaptive decoder.  */
+    memcpy(model, header + 6, 2);
+    if (!(*flags & HUF_FLAG_ADAPTIVE) && (model[0] != 0 || model[1] != 0))
+        return HUF_ERROR_FORMAT;
+
+    *block_size = _load_le32(header + 8);
+    if (*block_size < HUF_MIN_BLOCK_SIZE || *block_size > HUF_MAX_BLOCK_SIZE)
+        return HUF_ERROR_FORMAT;
+
+    return HUF_OK;
+}
@@ -0,0 +1,280 @@
+#ifndef HUF_FILE_FORMAT
+#define HUF_FILE_FORMAT
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "./huffman.h"
+#include "./pool.h"
+
+
+/* File starts with a header:
+ *
+ *     magic       4 bytes     "HUF\x1A"
+ *     version     1 byte      HUF_VERSION
+ *     flags       1 byte      HUF_FLAG_* or-ed
+ *     model       2 bytes     max code length and log2 of rebuild interval
+ *                             with HUF_FLAG_ADAPTIVE, otherwise 0
+ *     block size  4 bytes     little endian, uncompressed size of each block
+ *
+ * followed by blocks. Each block is prefixed with 4-byte little endian size
+ * of compressed data, which is output of huffman_compress for up to block
+ * size bytes of input. Every block except the last one holds exactly block
+ * size bytes. Blocks end with zero size, after which footer follows:
+ *
+ *     index       16 bytes    per block, little endian offset of its size
+ *                             prefix in file and offset of its data in
+ *                             uncompressed data, 8 bytes each
+ *     count       8 bytes     little endian number of blocks
+ *     total       8 bytes     little endian total uncompressed size
+ *
+ * Trailer of count and total is at the very end of file, so blocks of a
+ * seekable file can be found without reading all of them.
+ *
+ * Blocks are independent unless HUF_FLAG_REPEAT is set, then a block may
+ * repeat code table of a previous one and blocks are decompressed in
+ * order.
+ *
+ * With HUF_FLAG_ADAPTIVE blocks are chunks of one stream of
+ * huffman_adaptive_encode, each holding input as it came, up to block size
+ * bytes. They are decompressed in order, and the index has their actual
+ * offsets.  */
+
+#define HUF_MAGIC               "HUF\x1A"
+#define HUF_VERSION             2
+#define HUF_HEADER_SIZE         12
+#define HUF_FLAG_REPEAT         1
+#define HUF_FLAG_ADAPTIVE       2
+#define HUF_INDEX_ENTRY_SIZE    (8 + 8)
+#define HUF_TRAILER_SIZE        (8 + 8)
+
+#define HUF_MIN_BLOCK_SIZE      ((uint32_t)1 << 10)
+#define HUF_MAX_BLOCK_SIZE      ((uint32_t)1 << 26)
+#define HUF_DEFAULT_BLOCK_SIZE  ((uint32_t)1 << 18)
+
+#define HUF_MAX_THREADS         256
+
+#define HUF_EXTENSION           ".huf"
+
+
+/* ________ "Public" functions and structures. ________ */
+
+enum huf_status {
+    HUF_OK = 0,
+    HUF_ERROR_READ,         /* Input can not be read.  */
+    HUF_ERROR_WRITE,        /* Output can not be written.  */
+    HUF_ERROR_FORMAT,       /* Input is not a valid .huf file.  */
+    HUF_ERROR_MEMORY,       /* Not enough memory.  */
+    HUF_ERROR_OPTIONS,      /* Options are out of range.  */
+    HUF_ERROR_SEEK          /* Input is not a regular file or is
+                             * adaptive.  */
+};
+
+struct huf_options {
+    uint32_t    block_size;         /* [HUF_MIN_BLOCK_SIZE, HUF_MAX_BLOCK_SIZE]. */
+    uint8_t     max_code_length;    /* See huffman_ctx_set_max_code_length.  */
+    uint8_t     streams;            /* See huffman_ctx_set_streams.  */
+    uint8_t     clusters;           /* See huffman_ctx_set_clusters.  */
+    bool        repeat;             /* See huffman_ctx_set_repeat, blocks
+                                     * are compressed by one thread.  */
+    uint32_t    sync_interval;      /* See huffman_ctx_set_sync_interval.  */
+    uint32_t    adaptive_interval;  /* 0, or power of two for adaptive
+                                     * coding, see
+                                     * huffman_adaptive_set_interval.  */
+    unsigned    threads;            /* 0 for one per processor, at most
+                                     * HUF_MAX_THREADS.  */
+    struct huffman_stats * stats;   /* Added to if not NULL, see
+                                     * huffman_ctx_set_stats.  */
+};
+
+/* Fill options with default values.  */
+void
+huf_default_options(struct huf_options *);
+
+/* Compress stream in into stream out block by block, so memory in use
+ * depends on block size and number of threads only. Regular file in is
+ * mapped and compressed in place instead of being read into buffers.
+ * Reading, compression and writing overlap: input is read by its own
+ * thread, blocks are compressed by threads workers and written in order by
+ * the calling thread. With adaptive interval input is coded as it comes,
+ * without waiting for a whole block, and each chunk is written and flushed
+ * at once, see huffman_adaptive_encode.  */
+enum huf_status
+huf_compress_file(FILE * in, FILE * out, struct huf_options const *);
+
+/* Decompress stream in, previously compressed by huf_compress_file, into
+ * stream out block by block. Chunks of adaptive stream are flushed as soon
+ * as they are decoded. When both streams are regular files, out is not
+ * opened for appending and holds nothing past its position, blocks are
+ * found through the index and decompressed concurrently by threads, each
+ * written at its final position. If out is also open for reading, both
+ * files are mapped and blocks are decoded from one into the other.
+ * Statistics are added to stats unless it is NULL.  */
+enum huf_status
+huf_decompress_file(FILE * in, FILE * out, unsigned threads,
+    struct huffman_stats * stats);
+
+/* Decompress length bytes from offset of original data out of regular
+ * file in, previously compressed by huf_compress_file, into stream out.
+ * Blocks covering the slice are found through the index and only their
+ * streams covering it are decoded, so it costs about as much as the slice
+ * itself, plus a block or sync interval (see huf_options). Blocks which
+ * repeat code table of a previous one are decoded along with the block it
+ * comes from. Slice is cut to the end of data. Adaptive files can only be
+ * decompressed as a whole. Statistics are added to stats unless it is
+ * NULL.  */
+enum huf_status
+huf_decompress_range(FILE * in, FILE * out, uint64_t offset, uint64_t length,
+    struct huffman_stats * stats);
+
+/* Human readable description of status.  */
+char const *
+huf_status_string(enum huf_status);
+
+
+/* ________ "Private"  functions and structures. ________ */
+
+struct _huf_map;
+
+struct _huf_block;
+
+struct _huf_compressor;
+
+/* Allocate buffers of compressor c for given options, or map the rest of
+ * in instead if it is a regular file. On failure c is still to be freed by
+ * _free_compressor.  */
+static enum huf_status
+_create_compressor(struct _huf_compressor * c,
+    struct huf_options const *, unsigned threads, FILE * in);
+
+static void
+_free_compressor(struct _huf_compressor *);
+
+/* Thread of compressor c reading blocks into free slots and handing them
+ * to workers.  */
+static void *
+_read_blocks(void * c);
+
+/* Pool task compressing one block with context of the worker.  */
+static void
+_compress_block(void * block, unsigned worker);
+
+/* Compress stream in into stream out with adaptive codes, coding input as
+ * soon as it is read. Options are checked.  */
+static enum huf_status
+_compress_adaptive(FILE * in, FILE * out, struct huf_options const *);
+
+/* Create state of adaptive coding with given max code length and log2 of
+ * rebuild interval.  */
+static enum huf_status
+_create_adaptive(struct huffman_adaptive **, uint8_t max_code_length,
+    uint8_t interval_bits);
+
+struct _huf_index_entry;
+
+struct _huf_index;
+
+struct _huf_decompressor;
+
+struct _huf_block_task;
+
+/* Append entry to index. Returns false if there is not enough memory.  */
+static bool
+_index_push(struct _huf_index *, uint64_t offset, uint64_t raw_offset);
+
+/* Write end marker, index and trailer.  */
+static enum huf_status
+_write_footer(FILE *, struct _huf_index const *, uint64_t total);
+
+/* Read footer following end marker and check that it matches index of
+ * decoded blocks.  */
+static enum huf_status
+_check_footer(FILE *, struct _huf_index const *, uint64_t total);
+
+/* Read index and trailer from the end of input of d and check that blocks
+ * they describe fit the file.  */
+static enum huf_status
+_read_index(struct _huf_decompressor * d);
+
+/* Read block of d into packed, which has room for its size prefix and
+ * bound bytes, and check its size prefix and decompressed size. Returns
+ * size of compressed data following the prefix and decompressed size
+ * through pointers.  */
+static enum huf_status
+_read_block(struct _huf_decompressor * d, uint64_t block, uint8_t * packed,
+    size_t * size, size_t * expected);
+
+/* Decompress blocks of regular file in into regular file out with a pool
+ * of threads, which decompresses blocks in order if it has one thread.
+ * Header is already read.  */
+static enum huf_status
+_decompress_blocks(FILE * in, FILE * out, uint32_t block_size,
+    unsigned threads, struct huffman_stats *);
+
+/* Pool task decompressing one block with context of the worker.  */
+static void
+_decompress_block(void * task, unsigned worker);
+
+static bool
+_is_regular_file(FILE *);
+
+/* True if blocks can be written at their final positions in f: it is a
+ * regular file not opened for appending, which ignores offsets, and holds
+ * nothing past its position, which reserving output would cut off.  */
+static bool
+_is_positional_output(FILE *);
+
+/* Map n bytes of file fd from offset, for reading or for both reading and
+ * writing. Returns false if region is empty or can not be mapped.  */
+static bool
+_map_file(struct _huf_map *, int fd, uint64_t offset, uint64_t n,
+    bool writable);
+
+static void
+_unmap_file(struct _huf_map *);
+
+/* Positioned read and write of n bytes, which do not move file offset and
+ * can be used by several threads at once. Return number of bytes
+ * transferred, which is less than n on error or at end of file.  */
+static size_t
+_pread_full(int fd, void *, size_t n, uint64_t offset);
+
+static size_t
+_pwrite_full(int fd, void const *, size_t n, uint64_t offset);
+
+static void
+_store_le32(uint8_t *, uint32_t);
+
+static void
+_store_le64(uint8_t *, uint64_t);
+
+static uint32_t
+_load_le32(uint8_t const *);
+
+static uint64_t
+_load_le64(uint8_t const *);
+
+/* Read up to n bytes, stopping at end of file only. Returns number of
+ * bytes read, which is less than n at end of file or on error.  */
+static size_t
+_read_full(FILE *, void *, size_t n);
+
+/* Write file header, model is 2 bytes of adaptive model or NULL.  */
+static enum huf_status
+_write_header(FILE *, uint32_t block_size, uint8_t flags,
+    uint8_t const * model);
+
+/* Read and check file header. Returns block size, flags and 2 bytes of
+ * adaptive model through pointers.  */
+static enum huf_status
+_read_header(FILE *, uint32_t * block_size, uint8_t * flags,
+    uint8_t * model);
+
+#endif
@@ -1,582 +1,2898 @@
 #include "./huffman.h"
 
 
+/* Leaves are stored first and sorted by value, internal nodes follow in
+ * order of creation, so every node comes after its children and root is
+ * the last one.  */
+struct _huffman_tree_node {
+    uint64_t    value;
+    uint16_t    left, right;    /* Indices of children in array of nodes.  */
+    uint8_t     key;
+    uint8_t     depth;
+};
+
+
 struct huffman_tree {
-    struct _huffman_tree_node * root;
+    /* Tree of DEFAULT_HEAP_SIZE leaves has one node less than twice as
+     * many.  */
+    struct _huffman_tree_node   nodes[2 * DEFAULT_HEAP_SIZE - 1];
+    uint16_t                    leaves;
+    uint16_t                    size;
+    uint8_t                     height;
+};
+
+
+struct _decode_entry {
+    uint8_t symbol;
+    uint8_t length;     /* 0 if code is longer than table bits.  */
+};
+
+
+struct _long_code {
+    uint64_t    start;  /* Prefix code aligned to the most significant bit.  */
+    uint8_t     length;
+    uint8_t     symbol;
+};
+
+
+/* Primary table is indexed by the next bits bits of input and resolves
+ * every code that is not longer. It is as wide as the longest code unless
+ * that is longer than HUFFMAN_MAX_TABLE_BITS, then it is HUFFMAN_TABLE_BITS
+ * wide and longer codes are found by binary search over all codes sorted by
+ * their left-aligned value.  */
+struct _decode_table {
+    struct _decode_entry    primary[1 << HUFFMAN_MAX_TABLE_BITS];
+    struct _long_code       codes[256];
+    uint16_t                size;
+    uint8_t                 max_length;
+    uint8_t                 bits;
+};
+
+
+struct _encode_entry {
+    uint64_t    code;   /* Canonical code aligned to the least significant bit.  */
+    uint8_t     length;
+};
+
+
+/* Bits are accumulated most significant bit first and stored by whole
+ * 64-bit words, of which only completed bytes are kept.  */
+struct _bit_writer {
+    uint8_t *   begin;
+    uint8_t *   next;
+    uint8_t *   end;
+    uint64_t    bits;   /* Pending bits, most significant bit first.  */
+    uint8_t     count;  /* Number of pending bits.  */
+};
+
+
+struct _bit_reader {
+    uint8_t const * next;
+    uint8_t const * end;
+    uint64_t        bits;   /* Buffered bits, most significant bit first.  */
+    uint8_t         count;  /* Number of valid bits in buffer.  */
+    uint64_t        overrun;    /* Number of zero bytes read past the end.  */
+};
+
+
+/* Streams of a block as they are read: sizes of all but the last one are
+ * stored before the streams themselves.  */
+struct _stream_layout {
+    size_t          streams;
+    size_t          segment;    /* Symbols in each stream but the last.  */
+    size_t          next;       /* Index of the next stream.  */
+    uint8_t         width;      /* Bytes of each stream size.  */
+    uint8_t const * sizes;
+    uint8_t const * data;       /* Of the next stream.  */
+    size_t          left;       /* Bytes from the next stream to the end.  */
+};
+
+
+/* Codes of a context block. Every context has a pointer to table of its
+ * cluster, so that picking the table costs a single load.  */
+struct _context_model {
+    uint8_t                         clusters;
+    uint8_t                         map[256];   /* Cluster of each context.  */
+    uint8_t                         max_length; /* Over all clusters.  */
+    uint8_t                         lengths[HUFFMAN_MAX_CLUSTERS][256];
+
+    struct _encode_entry            encode_tables[HUFFMAN_MAX_CLUSTERS][256];
+    struct _decode_entry            decode_tables[HUFFMAN_MAX_CLUSTERS]
+                                        [1 << HUFFMAN_TABLE_BITS];
+    struct _encode_entry const *    encode_by_context[256];
+    struct _decode_entry const *    decode_by_context[256];
+
+    /* Used by compression only.  */
+    uint32_t                        counts[256][256];   /* By context.  */
+    uint64_t                        cluster_counts[HUFFMAN_MAX_CLUSTERS][256];
+    double                          bits[256][HUFFMAN_MAX_CLUSTERS];
+};
+
+
+/* Entry points of a kernel.  */
+struct _huffman_kernel {
+    char const * name;
+
+    void (* count_chunk)(uint8_t const * src, size_t n,
+        uint32_t (* tables)[256]);
+
+    void (* encode)(uint8_t const * src, size_t n,
+        struct _encode_entry const * table, uint8_t max_length,
+        struct _bit_writer * w);
+
+    bool (* decode)(uint8_t const * src, size_t n, uint8_t * dst,
+        size_t size, struct _decode_table const * table);
+
+    bool (* decode_interleaved)(uint8_t const * const * src,
+        size_t const * n, uint8_t * dst, size_t size,
+        struct _decode_table const * table);
+};
+
+
+static struct _huffman_kernel const _kernels[HUFFMAN_KERNELS] = {
+    [HUFFMAN_KERNEL_GENERIC] = {
+        "generic", _count_chunk, _encode_using_table, _decode_using_table,
+        _decode_interleaved
+    },
+
+#ifdef HUFFMAN_X86_KERNELS
+    [HUFFMAN_KERNEL_BMI2] = {
+        "bmi2", _count_chunk_avx2, _encode_bmi2, _decode_bmi2,
+        _decode_interleaved_bmi2
+    },
+#endif
+};
+
+
+static enum huffman_kernel _kernel = HUFFMAN_KERNEL_GENERIC;
+
+
+/* Everything compression and decompression need besides input and output,
+ * so that a context reused between calls allocates nothing.  */
+struct huffman_ctx {
+    uint8_t                 max_code_length;
+    uint8_t                 streams;
+    bool                    repeat;
+    size_t                  sync_interval;  /* 0 without sync points.  */
+    uint8_t                 clusters;       /* 0 or 1 without contexts.  */
+    struct huffman_stats *  stats;      /* NULL if not collected.  */
+
+    /* Whether tables of the previous call can be repeated.  */
+    bool                    has_encode_table;
+    bool                    has_decode_table;
+    uint8_t                 max_length;     /* Of encode table.  */
+
+    struct huffman_tree     tree;
+    uint64_t                counts[256];
+    uint8_t                 lengths[256];
+    struct _encode_entry    encode_table[256];
+    struct _decode_table    decode_table;
+    struct _context_model * model;      /* NULL until it is needed.  */
+};
+
+
+/* Both sides of a stream count the same symbols and rebuild codes after
+ * the same ones, so they always have the same codes.  */
+struct huffman_adaptive {
+    size_t                  interval;
+    uint8_t                 max_code_length;
+
+    uint64_t                symbols;    /* Coded so far.  */
+    size_t                  period;     /* Between the last rebuilds.  */
+    size_t                  left;       /* Until the next rebuild.  */
+
+    uint64_t                total;      /* Of counts.  */
+    uint64_t                counts[256];
+    uint8_t                 lengths[256];
+    uint8_t                 max_length;
+
+    struct huffman_tree     tree;
+    struct _encode_entry    encode_table[256];
+    struct _decode_table    decode_table;
+};
+
+
+/* Code table fixed in advance. It has a code for every byte value, so any
+ * input can be coded with it.  */
+struct huffman_table {
+    uint32_t                id;
+    uint8_t                 max_length;
+    uint8_t                 lengths[256];
+    struct _encode_entry    encode_table[256];
+    struct _decode_table    decode_table;
 };
 
 
-struct _huffman_tree_node {
-    char        key;
-    uint64_t    value;
-    bool        is_leaf;
+struct huffman_tree *
+huffman(void const * src, size_t n) {
+    uint64_t counts[256];
+    _count_frequencies(src, n, counts);
+
+    struct huffman_tree * t = malloc(sizeof(struct huffman_tree));
+    if (t != NULL)
+        _build_huffman_tree(t, counts);
+
+    return t;
+}
+
+
+enum huffman_kernel
+huffman_get_kernel(void) {
+    return _kernel;
+}
+
+
+bool
+huffman_set_kernel(enum huffman_kernel kernel) {
+    if (!_kernel_supported(kernel))
+        return false;
+
+    _kernel = kernel;
+
+    return true;
+}
+
+
+char const *
+huffman_kernel_name(enum huffman_kernel kernel) {
+    if (kernel >= HUFFMAN_KERNELS || _kernels[kernel].name == NULL)
+        return "unknown";
+
+    return _kernels[kernel].name;
+}
+
+
+struct huffman_ctx *
+huffman_ctx_create(void) {
+    struct huffman_ctx * ctx = malloc(sizeof(struct huffman_ctx));
+    if (ctx != NULL) {
+        ctx->model = NULL;
+        huffman_ctx_reset(ctx);
+    }
+
+    return ctx;
+}
+
+
+bool
+huffman_ctx_set_streams(struct huffman_ctx * ctx, uint8_t streams) {
+    if (streams != 1 && streams != HUFFMAN_STREAMS)
+        return false;
+
+    ctx->streams = streams;
+
+    return true;
+}
+
+
+void
+huffman_ctx_set_repeat(struct huffman_ctx * ctx, bool repeat) {
+    ctx->repeat = repeat;
+}
+
+
+bool
+huffman_ctx_set_sync_interval(struct huffman_ctx * ctx, size_t interval) {
+    if (interval != 0 && interval < HUFFMAN_MIN_SYNC_INTERVAL)
+        return false;
+
+    ctx->sync_interval = interval;
+
+    return true;
+}
+
+
+bool
+huffman_ctx_set_max_code_length(struct huffman_ctx * ctx, uint8_t length) {
+    if (length < HUFFMAN_MIN_CODE_LENGTH_LIMIT
+            || length > HUFFMAN_MAX_DECODE_LENGTH)
+        return false;
+
+    ctx->max_code_length = length;
+
+    return true;
+}
+
+
+bool
+huffman_ctx_set_clusters(struct huffman_ctx * ctx, uint8_t clusters) {
+    if (clusters > HUFFMAN_MAX_CLUSTERS)
+        return false;
+
+    ctx->clusters = clusters;
+
+    return true;
+}
+
+
+void
+huffman_ctx_reset(struct huffman_ctx * ctx) {
+    ctx->max_code_length = HUFFMAN_DEFAULT_MAX_CODE_LENGTH;
+    ctx->streams         = HUFFMAN_STREAMS;
+    ctx->repeat          = false;
+    ctx->sync_interval   = 0;
+    ctx->clusters        = 0;
+    ctx->stats           = NULL;
+
+    ctx->has_encode_table   = false;
+    ctx->has_decode_table   = false;
+
+    ctx->tree.leaves    = 0;
+    ctx->tree.size      = 0;
+}
+
+
+bool
+huffman_ctx_set_stats(struct huffman_ctx * ctx, struct huffman_stats * stats) {
+#ifdef HUFFMAN_STATS
+    ctx->stats = stats;
+    return true;
+#else
+    (void)ctx;
+    (void)stats;
+    return false;
+#endif
+}
+
+
+void
+huffman_stats_add(struct huffman_stats * to, struct huffman_stats const * from)
+{
+    to->histogram_ns    += from->histogram_ns;
+    to->build_ns        += from->build_ns;
+    to->encode_ns       += from->encode_ns;
+    to->decode_ns       += from->decode_ns;
+    to->io_ns           += from->io_ns;
+
+    to->bytes_in        += from->bytes_in;
+    to->bytes_out       += from->bytes_out;
+    to->header_bytes    += from->header_bytes;
+    to->allocations     += from->allocations;
+
+    for (uint8_t k = 0; k < HUFFMAN_BLOCK_TYPES; ++k)
+        to->blocks[k] += from->blocks[k];
+
+    if (to->max_symbols < from->max_symbols)
+        to->max_symbols = from->max_symbols;
+
+    if (to->max_code_length < from->max_code_length)
+        to->max_code_length = from->max_code_length;
+}
+
+
+void
+huffman_ctx_free(struct huffman_ctx * ctx) {
+    if (ctx != NULL)
+        free(ctx->model);
+
+    free(ctx);
+}
+
+
+size_t
+huffman_compress_bound(size_t n) {
+    /* Size and type of raw block.  */
+    return HUFFMAN_MAX_VARINT_SIZE + 1 + n;
+}
+
+
+size_t
+huffman_compress(void const * src, size_t n, void * dst, size_t cap) {
+    /* Context is too large for small thread stacks.  */
+    struct huffman_ctx * ctx = huffman_ctx_create();
+    if (ctx == NULL)
+        return HUFFMAN_ERROR;
+
+    size_t size = huffman_compress_ctx(ctx, src, n, dst, cap);
+    huffman_ctx_free(ctx);
+
+    return size;
+}
+
+
+size_t
+huffman_decompress(void const * src, size_t n, void * dst, size_t cap) {
+    struct huffman_ctx * ctx = huffman_ctx_create();
+    if (ctx == NULL)
+        return HUFFMAN_ERROR;
+
+    size_t size = huffman_decompress_ctx(ctx, src, n, dst, cap);
+    huffman_ctx_free(ctx);
+
+    return size;
+}
+
+
+size_t
+huffman_decompressed_size(void const * src, size_t n) {
+    uint64_t size;
+    if (_read_varint(src, n, &size) == 0 || size >= HUFFMAN_ERROR)
+        return HUFFMAN_ERROR;
+
+    return size;
+}
+
+
+int
+huffman_block_type(void const * src, size_t n) {
+    uint8_t const * in = src;
+
+    uint64_t size;
+    size_t header_size = _read_varint(in, n, &size);
+    if (header_size == 0 || size == 0 || header_size == n)
+        return -1;
+
+    uint8_t type = in[header_size] & HUFFMAN_BLOCK_TYPE_MASK;
+
+    return type < HUFFMAN_BLOCK_TYPES ? type : -1;
+}
+
+
+size_t
+huffman_decompress_range(void const * src, size_t n, size_t offset,
+    size_t length, void * dst)
+{
+    struct huffman_ctx * ctx = huffman_ctx_create();
+    if (ctx == NULL)
+        return HUFFMAN_ERROR;
+
+    size_t size = huffman_decompress_range_ctx(ctx, src, n, offset, length,
+        dst);
+    huffman_ctx_free(ctx);
+
+    return size;
+}
+
+
+size_t
+huffman_compress_ctx(struct huffman_ctx * ctx, void const * src, size_t n,
+    void * dst, size_t cap)
+{
+    uint8_t * out = dst;
+
+    /* Header is prepared aside, so that output of exact size fits.  */
+    uint8_t header[HUFFMAN_MAX_HEADER_SIZE];
+    size_t size = _write_varint(header, n);
+
+    if (n == 0) {
+        if (cap < size)
+            return HUFFMAN_ERROR;
+
+        memcpy(out, header, size);
+        HUFFMAN_STATS_ADD(ctx->stats, bytes_out, size);
+        return size;
+    }
+
+    HUFFMAN_STATS_START(ctx->stats, histogram_start);
+    _count_frequencies(src, n, ctx->counts);
+
+    uint16_t symbols = 0;
+    uint8_t symbol = 0;
+    for (uint16_t j = 0; j < 256; ++j)
+        if (ctx->counts[j] != 0) {
+            ++symbols;
+            symbol = j;
+        }
+
+    HUFFMAN_STATS_TIME(ctx->stats, histogram_ns, histogram_start);
+    HUFFMAN_STATS_MAX(ctx->stats, max_symbols, symbols);
+
+    if (symbols == 1) {
+        header[size++] = HUFFMAN_BLOCK_RLE;
+        header[size++] = symbol;
+
+        if (cap < size)
+            return HUFFMAN_ERROR;
+
+        memcpy(out, header, size);
+        HUFFMAN_STATS_BLOCK(ctx->stats, HUFFMAN_BLOCK_RLE, n, size, size);
+        return size;
+    }
+
+    HUFFMAN_STATS_START(ctx->stats, build_start);
+
+    bool repeat = ctx->repeat && ctx->has_encode_table
+        && _can_repeat(ctx->counts, ctx->lengths, n);
+
+    /* Tables are not valid until a block coded with them is written.  */
+    if (!repeat) {
+        ctx->has_encode_table = false;
+
+        _build_huffman_tree(&ctx->tree, ctx->counts);
+        _limit_code_lengths(&ctx->tree, ctx->max_code_length);
+        ctx->max_length = _get_code_lengths(&ctx->tree, ctx->lengths);
+    }
+
+    uint8_t max_length = ctx->max_length;
+    HUFFMAN_STATS_MAX(ctx->stats, max_code_length, max_length);
+
+    size_t raw_size = size + 1 + n;
+    size_t interval = ctx->sync_interval;
+    uint8_t layout = interval != 0 && n > interval ? HUFFMAN_BLOCK_SYNC
+        : n >= HUFFMAN_MIN_INTERLEAVED_SIZE && ctx->streams > 1
+            ? HUFFMAN_BLOCK_INTERLEAVED : 0;
+    uint8_t type = (repeat ? HUFFMAN_BLOCK_REPEAT : HUFFMAN_BLOCK_CODED)
+        | layout;
+    header[size++] = type;
+
+    /* Only code lengths are stored, the codes themselves are restored by
+     * the decoder the same way they were assigned.  */
+    if (!repeat)
+        size += _write_code_lengths(ctx->lengths, header + size);
+
+    /* Size of codes is known from counts. Blocks that would not become
+     * smaller are stored as is without coding them.  */
+    uint64_t coded_size = size
+        + _streams_overhead(type, n, interval, max_length)
+        + _coded_size(ctx->counts, ctx->lengths);
+
+    /* Context codes pay for their larger header only where they come out
+     * shorter than codes of a single table.  */
+    if (ctx->clusters > 1 && n >= HUFFMAN_MIN_CONTEXT_SIZE) {
+        size_t context_size = _compress_context(ctx, src, n, layout,
+            coded_size < raw_size ? coded_size : raw_size, out, cap);
+        if (context_size != 0)
+            return context_size;
+    }
+
+    if (coded_size >= raw_size) {
+        size = raw_size - 1 - n;
+        header[size++] = HUFFMAN_BLOCK_RAW;
+
+        if (cap < raw_size)
+            return HUFFMAN_ERROR;
+
+        memcpy(out, header, size);
+        memcpy(out + size, src, n);
+        HUFFMAN_STATS_TIME(ctx->stats, build_ns, build_start);
+        HUFFMAN_STATS_BLOCK(ctx->stats, HUFFMAN_BLOCK_RAW, n, raw_size, size);
+        return raw_size;
+    }
+
+    if (cap < size)
+        return HUFFMAN_ERROR;
+
+    memcpy(out, header, size);
+
+    if (!repeat)
+        _build_encode_table(ctx->lengths, ctx->encode_table);
+
+    HUFFMAN_STATS_TIME(ctx->stats, build_ns, build_start);
+    HUFFMAN_STATS_START(ctx->stats, encode_start);
+
+    size_t payload_size = _encode_streams(src, n, ctx->encode_table,
+        max_length, type, interval, out + size, cap - size, NULL);
+    if (payload_size == HUFFMAN_ERROR)
+        return HUFFMAN_ERROR;
+
+    HUFFMAN_STATS_TIME(ctx->stats, encode_ns, encode_start);
+    HUFFMAN_STATS_BLOCK(ctx->stats,
+        repeat ? HUFFMAN_BLOCK_REPEAT : HUFFMAN_BLOCK_CODED, n,
+        size + payload_size, size);
+
+    ctx->has_encode_table = true;
+
+    return size + payload_size;
+}
+
+
+size_t
+huffman_decompress_ctx(struct huffman_ctx * ctx, void const * src, size_t n,
+    void * dst, size_t cap)
+{
+    uint8_t const * in = src;
+
+    uint64_t size;
+    size_t header_size = _read_varint(in, n, &size);
+    if (header_size == 0 || size > cap)
+        return HUFFMAN_ERROR;
+
+    if (size == 0) {
+        HUFFMAN_STATS_ADD(ctx->stats, bytes_in, header_size);
+        return 0;
+    }
+
+    if (header_size == n)
+        return HUFFMAN_ERROR;
+
+    uint8_t type = in[header_size++];
+
+    if (type == HUFFMAN_BLOCK_RAW) {
+        if (n - header_size != size)
+            return HUFFMAN_ERROR;
+
+        memcpy(dst, in + header_size, size);
+        HUFFMAN_STATS_BLOCK(ctx->stats, HUFFMAN_BLOCK_RAW, n, size,
+            header_size);
+        return size;
+    }
+
+    if (type == HUFFMAN_BLOCK_RLE) {
+        if (n - header_size != 1)
+            return HUFFMAN_ERROR;
+
+        memset(dst, in[header_size], size);
+        HUFFMAN_STATS_BLOCK(ctx->stats, HUFFMAN_BLOCK_RLE, n, size, n);
+        return size;
+    }
+
+    struct _context_model const * model = NULL;
+
+    switch (type & HUFFMAN_BLOCK_TYPE_MASK) {
+        case HUFFMAN_BLOCK_CODED: {
+            /* Lengths of context are kept for repeated encode table.  */
+            uint8_t lengths[256];
+            size_t alphabet_size = \
+                _read_code_lengths(in + header_size, n - header_size, lengths);
+            if (alphabet_size == 0)
+                return HUFFMAN_ERROR;
+
+            header_size += alphabet_size;
+
+            HUFFMAN_STATS_START(ctx->stats, build_start);
+            ctx->has_decode_table = \
+                _build_decode_table(lengths, &ctx->decode_table);
+            if (!ctx->has_decode_table)
+                return HUFFMAN_ERROR;
+
+            HUFFMAN_STATS_TIME(ctx->stats, build_ns, build_start);
+
+            break;
+        }
+
+        case HUFFMAN_BLOCK_REPEAT:
+            if (!ctx->has_decode_table)
+                return HUFFMAN_ERROR;
+
+            break;
+
+        /* Table of the last coded block is kept for repeated ones.  */
+        case HUFFMAN_BLOCK_CONTEXT: {
+            if (!_ensure_model(ctx))
+                return HUFFMAN_ERROR;
+
+            HUFFMAN_STATS_START(ctx->stats, build_start);
+            size_t model_size = _read_context_model(in + header_size,
+                n - header_size, ctx->model);
+            if (model_size == 0)
+                return HUFFMAN_ERROR;
+
+            header_size += model_size;
+            model = ctx->model;
+            HUFFMAN_STATS_TIME(ctx->stats, build_ns, build_start);
+
+            break;
+        }
+
+        default:
+            return HUFFMAN_ERROR;
+    }
+
+    HUFFMAN_STATS_START(ctx->stats, decode_start);
+
+    if (!_decode_streams(type, in + header_size, n - header_size, dst, size,
+            &ctx->decode_table, model))
+        return HUFFMAN_ERROR;
+
+    HUFFMAN_STATS_TIME(ctx->stats, decode_ns, decode_start);
+    HUFFMAN_STATS_MAX(ctx->stats, max_code_length, model != NULL
+        ? model->max_length : ctx->decode_table.max_length);
+    HUFFMAN_STATS_BLOCK(ctx->stats, type & HUFFMAN_BLOCK_TYPE_MASK, n, size,
+        header_size);
+
+    return size;
+}
+
+
+size_t
+huffman_decompress_range_ctx(struct huffman_ctx * ctx, void const * src,
+    size_t n, size_t offset, size_t length, void * dst)
+{
+    uint8_t const * in = src;
+
+    uint64_t size;
+    size_t header_size = _read_varint(in, n, &size);
+    if (header_size == 0 || size >= HUFFMAN_ERROR)
+        return HUFFMAN_ERROR;
+
+    /* Slice is cut to the end of data.  */
+    if (offset > size)
+        offset = size;
+
+    if (length > size - offset)
+        length = size - offset;
+
+    if (size == 0)
+        return 0;
+
+    if (header_size == n)
+        return HUFFMAN_ERROR;
+
+    uint8_t type = in[header_size++];
+
+    if (type == HUFFMAN_BLOCK_RAW) {
+        if (n - header_size != size)
+            return HUFFMAN_ERROR;
+
+        memcpy(dst, in + header_size + offset, length);
+        return length;
+    }
+
+    if (type == HUFFMAN_BLOCK_RLE) {
+        if (n - header_size != 1)
+            return HUFFMAN_ERROR;
+
+        memset(dst, in[header_size], length);
+        return length;
+    }
+
+    struct _context_model const * model = NULL;
+
+    switch (type & HUFFMAN_BLOCK_TYPE_MASK) {
+        case HUFFMAN_BLOCK_CODED: {
+            uint8_t lengths[256];
+            size_t alphabet_size = \
+                _read_code_lengths(in + header_size, n - header_size, lengths);
+            if (alphabet_size == 0)
+                return HUFFMAN_ERROR;
+
+            header_size += alphabet_size;
+
+            ctx->has_decode_table = \
+                _build_decode_table(lengths, &ctx->decode_table);
+            if (!ctx->has_decode_table)
+                return HUFFMAN_ERROR;
+
+            break;
+        }
+
+        case HUFFMAN_BLOCK_REPEAT:
+            if (!ctx->has_decode_table)
+                return HUFFMAN_ERROR;
+
+            break;
+
+        case HUFFMAN_BLOCK_CONTEXT: {
+            if (!_ensure_model(ctx))
+                return HUFFMAN_ERROR;
+
+            size_t model_size = _read_context_model(in + header_size,
+                n - header_size, ctx->model);
+            if (model_size == 0)
+                return HUFFMAN_ERROR;
+
+            header_size += model_size;
+            model = ctx->model;
+
+            break;
+        }
+
+        default:
+            return HUFFMAN_ERROR;
+    }
+
+    if (!_decode_streams_range(type, in + header_size, n - header_size, size,
+            offset, length, dst, &ctx->decode_table, model))
+        return HUFFMAN_ERROR;
+
+    return length;
+}
+
+
+struct huffman_table *
+huffman_table_train(void const * samples, size_t n, uint32_t id,
+    uint8_t max_code_length)
+{
+    if (max_code_length < HUFFMAN_MIN_CODE_LENGTH_LIMIT
+            || max_code_length > HUFFMAN_MAX_DECODE_LENGTH)
+        return NULL;
+
+    uint64_t counts[256];
+    _count_frequencies(samples, n, counts);
+
+    return _train_table(counts, id, max_code_length);
+}
+
+
+size_t
+huffman_table_save(struct huffman_table const * table, void * dst,
+    size_t cap)
+{
+    uint8_t buffer[HUFFMAN_MAX_TABLE_SIZE];
+    size_t size = _write_varint(buffer, table->id);
+    size += _write_code_lengths(table->lengths, buffer + size);
+
+    if (cap < size)
+        return HUFFMAN_ERROR;
+
+    memcpy(dst, buffer, size);
+
+    return size;
+}
+
+
+struct huffman_table *
+huffman_table_load(void const * src, size_t n) {
+    uint8_t const * in = src;
+
+    uint64_t id;
+    size_t size = _read_varint(in, n, &id);
+    if (size == 0 || id > UINT32_MAX)
+        return NULL;
+
+    uint8_t lengths[256];
+    uint64_t alphabet_size = _read_code_lengths(in + size, n - size, lengths);
+    if (alphabet_size == 0 || size + alphabet_size != n)
+        return NULL;
+
+    return _create_table(id, lengths);
+}
+
+
+uint32_t
+huffman_table_id(struct huffman_table const * table) {
+    return table->id;
+}
+
+
+void
+huffman_table_free(struct huffman_table * table) {
+    free(table);
+}
+
+
+size_t
+huffman_compress_table(struct huffman_table const * table, void const * src,
+    size_t n, void * dst, size_t cap)
+{
+    uint8_t * out = dst;
+
+    uint8_t header[2 * HUFFMAN_MAX_VARINT_SIZE + 1];
+    size_t size = _write_varint(header, n);
+    size_t raw_size = size + 1 + n;
+
+    if (n == 0) {
+        if (cap < size)
+            return HUFFMAN_ERROR;
+
+        memcpy(out, header, size);
+        return size;
+    }
+
+    uint8_t type = HUFFMAN_BLOCK_STATIC
+        | (n >= HUFFMAN_MIN_INTERLEAVED_SIZE ? HUFFMAN_BLOCK_INTERLEAVED : 0);
+    header[size++] = type;
+    size += _write_varint(header + size, table->id);
+
+    /* Without counts coded size is not known in advance, so coding stops
+     * once it reaches raw size, and input is stored as is instead.  */
+    size_t limit = cap < raw_size ? cap : raw_size;
+    size_t payload_size = HUFFMAN_ERROR;
+
+    if (size < limit) {
+        memcpy(out, header, size);
+        payload_size = _encode_streams(src, n, table->encode_table,
+            table->max_length, type, 0, out + size, limit - size, NULL);
+    }
+
+    if (payload_size != HUFFMAN_ERROR && size + payload_size < raw_size)
+        return size + payload_size;
+
+    if (cap < raw_size)
+        return HUFFMAN_ERROR;
+
+    size = raw_size - 1 - n;
+    header[size++] = HUFFMAN_BLOCK_RAW;
+
+    memcpy(out, header, size);
+    memcpy(out + size, src, n);
+
+    return raw_size;
+}
+
+
+size_t
+huffman_decompress_table(struct huffman_table const * table,
+    void const * src, size_t n, void * dst, size_t cap)
+{
+    uint8_t const * in = src;
+
+    uint64_t size;
+    size_t header_size = _read_varint(in, n, &size);
+    if (header_size == 0 || size > cap)
+        return HUFFMAN_ERROR;
+
+    if (size == 0)
+        return 0;
+
+    if (header_size == n)
+        return HUFFMAN_ERROR;
+
+    uint8_t type = in[header_size++];
+
+    if (type == HUFFMAN_BLOCK_RAW) {
+        if (n - header_size != size)
+            return HUFFMAN_ERROR;
+
+        memcpy(dst, in + header_size, size);
+        return size;
+    }
+
+    if ((type & HUFFMAN_BLOCK_TYPE_MASK) != HUFFMAN_BLOCK_STATIC)
+        return HUFFMAN_ERROR;
+
+    /* Data of another table would decode to garbage.  */
+    uint64_t id;
+    size_t id_size = _read_varint(in + header_size, n - header_size, &id);
+    if (id_size == 0 || id != table->id)
+        return HUFFMAN_ERROR;
+
+    header_size += id_size;
+
+    if (!_decode_streams(type, in + header_size, n - header_size, dst, size,
+            &table->decode_table, NULL))
+        return HUFFMAN_ERROR;
+
+    return size;
+}
+
+
+size_t
+huffman_compress_batch_bound(struct huffman_record const * inputs,
+    size_t count)
+{
+    size_t bound = HUFFMAN_MAX_TABLE_SIZE;
+    for (size_t i = 0; i < count; ++i)
+        bound += huffman_compress_bound(inputs[i].size);
+
+    return bound;
+}
+
+
+size_t
+huffman_compress_batch(struct huffman_table const * table,
+    struct huffman_record const * inputs, size_t count, void * dst,
+    size_t cap, size_t * offsets)
+{
+    uint8_t * out = dst;
+    size_t size = 0;
+
+    /* Table of all inputs is trained on their total counts and saved
+     * before them.  */
+    struct huffman_table * trained = NULL;
+    if (table == NULL) {
+        uint64_t counts[256], record_counts[256];
+        memset(counts, 0, sizeof(counts));
+
+        for (size_t i = 0; i < count; ++i) {
+            _count_frequencies(inputs[i].data, inputs[i].size, record_counts);
+            for (uint16_t j = 0; j < 256; ++j)
+                counts[j] += record_counts[j];
+        }
+
+        table = trained = _train_table(counts, 0,
+            HUFFMAN_DEFAULT_MAX_CODE_LENGTH);
+        if (trained == NULL)
+            return HUFFMAN_ERROR;
+
+        size = huffman_table_save(trained, out, cap);
+    }
+
+    for (size_t i = 0; i < count && size != HUFFMAN_ERROR; ++i) {
+        offsets[i] = size;
+
+        size_t record_size = huffman_compress_table(table, inputs[i].data,
+            inputs[i].size, out + size, cap - size);
+        size = record_size == HUFFMAN_ERROR
+            ? HUFFMAN_ERROR : size + record_size;
+    }
+
+    offsets[count] = size;
+
+    huffman_table_free(trained);
+
+    return size;
+}
+
+
+size_t
+huffman_decompress_batch(struct huffman_table const * table,
+    void const * src, size_t const * offsets, size_t count, void * dst,
+    size_t cap, size_t * dst_offsets)
+{
+    uint8_t const * in = src;
+    uint8_t * out = dst;
+
+    struct huffman_table * loaded = NULL;
+    if (table == NULL) {
+        table = loaded = huffman_table_load(in, offsets[0]);
+        if (loaded == NULL)
+            return HUFFMAN_ERROR;
+    }
+
+    size_t size = 0;
+
+    for (size_t i = 0; i < count && size != HUFFMAN_ERROR; ++i) {
+        dst_offsets[i] = size;
+
+        size_t record_size = offsets[i] <= offsets[i + 1]
+            ? huffman_decompress_table(table, in + offsets[i],
+                offsets[i + 1] - offsets[i], out + size, cap - size)
+            : HUFFMAN_ERROR;
+        size = record_size == HUFFMAN_ERROR
+            ? HUFFMAN_ERROR : size + record_size;
+    }
+
+    dst_offsets[count] = size;
+
+    huffman_table_free(loaded);
+
+    return size;
+}
+
+
+struct huffman_adaptive *
+huffman_adaptive_create(void) {
+    struct huffman_adaptive * a = malloc(sizeof(struct huffman_adaptive));
+    if (a != NULL)
+        huffman_adaptive_reset(a);
+
+    return a;
+}
+
+
+void
+huffman_adaptive_reset(struct huffman_adaptive * a) {
+    a->interval         = HUFFMAN_ADAPTIVE_DEFAULT_INTERVAL;
+    a->max_code_length  = HUFFMAN_DEFAULT_MAX_CODE_LENGTH;
+
+    a->symbols  = 0;
+    a->period   = HUFFMAN_ADAPTIVE_MIN_INTERVAL;
+    a->left     = HUFFMAN_ADAPTIVE_MIN_INTERVAL;
+
+    /* Nothing is known yet, so all codes are 8 bits long.  */
+    for (uint16_t j = 0; j < 256; ++j)
+        a->counts[j] = 1;
+
+    a->total = 256;
+    _adaptive_build(a, true, true);
+}
+
+
+bool
+huffman_adaptive_set_interval(struct huffman_adaptive * a, size_t interval) {
+    if (interval < HUFFMAN_ADAPTIVE_MIN_INTERVAL
+            || interval > HUFFMAN_ADAPTIVE_MAX_INTERVAL || a->symbols != 0)
+        return false;
+
+    a->interval = interval;
+
+    return true;
+}
+
+
+bool
+huffman_adaptive_set_max_code_length(struct huffman_adaptive * a,
+    uint8_t length)
+{
+    if (length < HUFFMAN_MIN_CODE_LENGTH_LIMIT
+            || length > HUFFMAN_MAX_DECODE_LENGTH || a->symbols != 0)
+        return false;
+
+    a->max_code_length = length;
+
+    return true;
+}
+
+
+void
+huffman_adaptive_free(struct huffman_adaptive * a) {
+    free(a);
+}
+
+
+size_t
+huffman_adaptive_bound(struct huffman_adaptive const * a, size_t n) {
+    return HUFFMAN_MAX_VARINT_SIZE + (n * a->max_code_length + 7) / 8;
+}
+
+
+size_t
+huffman_adaptive_encode(struct huffman_adaptive * a, void const * src,
+    size_t n, void * dst, size_t cap)
+{
+    uint8_t const * in = src;
+    uint8_t * out = dst;
+
+    uint8_t header[HUFFMAN_MAX_VARINT_SIZE];
+    size_t size = _write_varint(header, n);
+    if (cap < size)
+        return HUFFMAN_ERROR;
+
+    memcpy(out, header, size);
+
+    struct _bit_writer w;
+    w.begin = w.next = out + size;
+    w.end   = out + cap;
+    w.bits  = 0;
+    w.count = 0;
+
+    /* Codes change between pieces of input only, and codes of the next
+     * piece continue the same bitstream.  */
+    for (size_t i = 0; i < n; ) {
+        size_t count = n - i < a->left ? n - i : a->left;
+
+        _kernels[_kernel].encode(in + i, count, a->encode_table,
+            a->max_length, &w);
+        _adaptive_update(a, in + i, count, false);
+        i += count;
+    }
+
+    size += _finish_bits(&w);
+    if (size > cap)
+        return HUFFMAN_ERROR;
+
+    return size;
+}
+
+
+size_t
+huffman_adaptive_decode(struct huffman_adaptive * a, void const * src,
+    size_t n, void * dst, size_t cap)
+{
+    uint8_t const * in = src;
+    uint8_t * out = dst;
+
+    uint64_t size;
+    size_t header_size = _read_varint(in, n, &size);
+    if (header_size == 0 || size > cap)
+        return HUFFMAN_ERROR;
+
+    struct _bit_reader r;
+    _init_reader(&r, in + header_size, n - header_size);
+
+    for (size_t i = 0; i < size; ) {
+        size_t count = size - i < a->left ? size - i : a->left;
+
+        if (!_decode_symbols(&r, out + i, count, &a->decode_table))
+            return HUFFMAN_ERROR;
+
+        _adaptive_update(a, out + i, count, true);
+        i += count;
+    }
+
+    /* Codes must not run into zeros read past the end of input.  */
+    if (r.overrun * 8 > r.count)
+        return HUFFMAN_ERROR;
+
+    return size;
+}
+
+
+uint64_t *
+get_char_frequencies(struct huffman_tree * t) {
+    uint64_t * counts = calloc(256, 8);  /* Alphabet size.  */
+    for (uint16_t i = 0; i < t->leaves; ++i)
+        counts[t->nodes[i].key] = t->nodes[i].value;
+
+    return counts;
+}
+
+
+char **
+get_huffman_codes(struct huffman_tree * t, char ** chars, uint8_t * size, 
+    uint8_t * memb_size)
+{
+    uint8_t lengths[256];
+    struct _encode_entry codes[256];
+
+    /* Memory used to store prefix code for a character always has free space
+     * (from 1 to 8 bits) to store 1 in it as a separator between valid
+     * prefix code and "junk" bits.  */
+    *memb_size = _get_code_lengths(t, lengths) / 8 + 1;
+    _build_encode_table(lengths, codes);
+    
+    *size = 0;
+    for (uint16_t i = 0; i < 256; ++i)
+        if (codes[i].length != 0) ++(*size);
+    
+    *chars = calloc(*size, sizeof(char));
+    char ** codes_strings = calloc(*size, sizeof(char *));
+
+    uint8_t index = 0;
+    for (uint16_t i = 0; i < 256; ++i) 
+        if (codes[i].length != 0) {
+            (*chars)[index] = (char)i;
+
+            codes_strings[index++] = \
+                _cast_prefix_code_to_cstring(codes[i].code, codes[i].length);
+        }
+
+    return codes_strings;
+}
+
+
+uint8_t
+height(struct huffman_tree * t) {
+    return t->height;
+}
+
+
+static void
+_count_frequencies(void const * src, size_t n, uint64_t * counts) {
+    uint8_t const * s = src;
+    uint32_t tables[HUFFMAN_HISTOGRAM_TABLES][256];
+
+    for (uint16_t j = 0; j < 256; ++j)
+        counts[j] = 0;
+
+    for (size_t i = 0; i < n; i += HUFFMAN_HISTOGRAM_CHUNK_SIZE) {
+        size_t size = n - i < HUFFMAN_HISTOGRAM_CHUNK_SIZE
+            ? n - i : HUFFMAN_HISTOGRAM_CHUNK_SIZE;
+
+        memset(tables, 0, sizeof(tables));
+
+        _kernels[_kernel].count_chunk(s + i, size, tables);
+
+        for (uint16_t j = 0; j < 256; ++j)
+            for (uint8_t k = 0; k < HUFFMAN_HISTOGRAM_TABLES; ++k)
+                counts[j] += tables[k][j];
+    }
+}
+
+
+static HUFFMAN_INLINE void
+_count_chunk(uint8_t const * src, size_t n, uint32_t (* tables)[256]) {
+    size_t i = 0;
+
+    for (; n - i >= 16; i += 16) {
+        uint64_t first, second;
+        memcpy(&first, src + i, 8);
+        memcpy(&second, src + i + 8, 8);
+
+        _count_word(tables, first);
+        _count_word(tables, second);
+    }
+
+    for (; i < n; ++i)
+        ++tables[0][src[i]];
+}
+
+
+static HUFFMAN_INLINE void
+_count_word(uint32_t (* tables)[256], uint64_t word) {
+    ++tables[0][word & 255];
+    ++tables[1][(word >> 8) & 255];
+    ++tables[2][(word >> 16) & 255];
+    ++tables[3][(word >> 24) & 255];
+    ++tables[0][(word >> 32) & 255];
+    ++tables[1][(word >> 40) & 255];
+    ++tables[2][(word >> 48) & 255];
+    ++tables[3][word >> 56];
+}
+
+
+#ifdef HUFFMAN_X86_KERNELS
+
+__attribute__((target("avx2")))
+static void
+_count_chunk_avx2(uint8_t const * src, size_t n, uint32_t (* tables)[256]) {
+    size_t i = 0;
+
+    for (; n - i >= 32; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((__m256i const *)(src + i));
+        __m256i first = _mm256_set1_epi8(src[i]);
+
+        uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, first));
+        if (equal == UINT32_MAX) {
+            tables[0][src[i]] += 32;
+            continue;
+        }
+
+        _count_word(tables, _mm256_extract_epi64(bytes, 0));
+        _count_word(tables, _mm256_extract_epi64(bytes, 1));
+        _count_word(tables, _mm256_extract_epi64(bytes, 2));
+        _count_word(tables, _mm256_extract_epi64(bytes, 3));
+    }
+
+    _count_chunk(src + i, n - i, tables);
+}
+
+
+#endif
+
+
+static void
+_sort_leaves(struct huffman_tree * t) {
+    struct _huffman_tree_node sorted[DEFAULT_HEAP_SIZE];
+
+    uint64_t max_value = 0;
+    for (uint16_t i = 0; i < t->leaves; ++i)
+        max_value |= t->nodes[i].value;
+
+    /* Least significant digit radix sort, one pass per byte of the largest
+     * value. It is stable, so equal values stay ordered by character.  */
+    for (uint8_t shift = 0; shift < 64 && max_value >> shift != 0; shift += 8) {
+        uint16_t offsets[256 + 1] = { 0 };
+
+        for (uint16_t i = 0; i < t->leaves; ++i)
+            ++offsets[((t->nodes[i].value >> shift) & 255) + 1];
+
+        for (uint16_t d = 0; d < 256; ++d)
+            offsets[d + 1] += offsets[d];
+
+        for (uint16_t i = 0; i < t->leaves; ++i)
+            sorted[offsets[(t->nodes[i].value >> shift) & 255]++] = t->nodes[i];
+
+        memcpy(t->nodes, sorted, t->leaves * sizeof(struct _huffman_tree_node));
+    }
+}
+
+
+static void
+_build_huffman_tree(struct huffman_tree * t, uint64_t const * counts) {
+    t->leaves = 0;
+
+    for (uint16_t j = 0; j < 256; ++j) {
+        if (counts[j] == 0)
+            continue;
+
+        struct _huffman_tree_node * n = t->nodes + t->leaves++;
+        n->value = counts[j];
+        n->key   = j;
+        n->left  = n->right = 0;
+        n->depth = 0;
+    }
+
+    /* Tree of empty input has no nodes, not even a root.  */
+    if (t->leaves == 0) {
+        t->size   = 0;
+        t->height = 0;
+        return;
+    }
+
+    _sort_leaves(t);
+
+    /* Two queues: sorted leaves and internal nodes, which are created in
+     * nondecreasing order of values. Two smallest nodes are always at the
+     * front of the queues, on equal values leaves go first.  */
+    uint16_t leaf = 0, internal = t->leaves;
+    t->size = t->leaves;
+
+    while (t->size < 2 * t->leaves - 1) {
+        uint16_t children[2];
+
+        for (uint8_t k = 0; k < 2; ++k) {
+            if (internal == t->size || (leaf < t->leaves
+                    && t->nodes[leaf].value <= t->nodes[internal].value))
+                children[k] = leaf++;
+            else
+                children[k] = internal++;
+        }
+
+        struct _huffman_tree_node * n = t->nodes + t->size++;
+        n->value = t->nodes[children[0]].value + t->nodes[children[1]].value;
+        n->left  = children[0];
+        n->right = children[1];
+        n->key   = 0;
+    }
+
+    /* Children precede their parents, so depths are set from root down.  */
+    t->nodes[t->size - 1].depth = 0;
+    t->height = 0;
+
+    for (uint16_t i = t->size - 1; i >= t->leaves; --i) {
+        uint8_t depth = t->nodes[i].depth + 1;
+        t->nodes[t->nodes[i].left].depth  = depth;
+        t->nodes[t->nodes[i].right].depth = depth;
+
+        if (depth > t->height)
+            t->height = depth;
+    }
+}
+
+
+static void
+_limit_code_lengths(struct huffman_tree * t, uint8_t limit) {
+    if (t->height <= limit)
+        return;
+
+    /* Number of codes of each length, too long codes are cut to limit.  */
+    uint16_t counts[HUFFMAN_MAX_DECODE_LENGTH + 1] = { 0 };
+    for (uint16_t i = 0; i < t->leaves; ++i)
+        ++counts[t->nodes[i].depth < limit ? t->nodes[i].depth : limit];
+
+    /* Cut codes break Kraft inequality: sum of 2^(limit - length) over all
+     * codes exceeds 2^limit. Each step removes one code of limit length and
+     * splits the longest shorter code into two one bit longer, which keeps
+     * the number of codes and reduces the sum by one.  */
+    uint64_t kraft = 0;
+    for (uint8_t length = 1; length <= limit; ++length)
+        kraft += (uint64_t)counts[length] << (limit - length);
+
+    while (kraft > (uint64_t)1 << limit) {
+        --counts[limit];
+
+        for (uint8_t length = limit - 1; length > 0; --length) {
+            if (counts[length] == 0)
+                continue;
+
+            --counts[length];
+            counts[length + 1] += 2;
+            break;
+        }
+
+        --kraft;
+    }
+
+    /* Leaves are sorted by value, so the rarest characters get the
+     * longest codes.  */
+    uint16_t leaf = 0;
+    for (uint8_t length = limit; length > 0; --length)
+        for (uint16_t k = 0; k < counts[length]; ++k)
+            t->nodes[leaf++].depth = length;
+
+    t->height = limit;
+}
+
+
+static uint8_t
+_get_code_lengths(struct huffman_tree * t, uint8_t * lengths) {
+    memset(lengths, 0, 256);
+
+    for (uint16_t i = 0; i < t->leaves; ++i)
+        lengths[t->nodes[i].key] = t->nodes[i].depth;
+
+    /* Tree of a single character consists of root only, but its code
+     * still needs one bit.  */
+    if (t->leaves == 1) {
+        lengths[t->nodes[0].key] = 1;
+        return 1;
+    }
+
+    return t->height;
+}
+
+
+static void
+_assign_canonical_codes(uint8_t const * lengths, uint64_t * codes) {
+    /* Codes of the same length are consecutive numbers in order of
+     * characters; first code of the next length follows the last code
+     * of the previous one shifted by one bit.  */
+    uint16_t numbers[HUFFMAN_MAX_DECODE_LENGTH + 1] = { 0 };
+    for (uint16_t i = 0; i < 256; ++i)
+        ++numbers[lengths[i]];
+
+    uint64_t next_codes[HUFFMAN_MAX_DECODE_LENGTH + 1];
+    uint64_t next_code = 0;
+    numbers[0] = 0;
+
+    for (uint8_t length = 1; length <= HUFFMAN_MAX_DECODE_LENGTH; ++length) {
+        next_code = (next_code + numbers[length - 1]) << 1;
+        next_codes[length] = next_code;
+    }
+
+    for (uint16_t i = 0; i < 256; ++i)
+        if (lengths[i] != 0)
+            codes[i] = next_codes[lengths[i]]++;
+}
+
+
+static void
+_build_encode_table(uint8_t const * lengths, struct _encode_entry * table) {
+    uint64_t codes[256];
+    _assign_canonical_codes(lengths, codes);
+
+    for (uint16_t i = 0; i < 256; ++i) {
+        table[i].code   = lengths[i] != 0 ? codes[i] : 0;
+        table[i].length = lengths[i];
+    }
+}
+
+
+static uint64_t
+_write_code_lengths(uint8_t const * lengths, uint8_t * out) {
+    uint16_t counter = 0, last = 0;
+    uint8_t max_length = 0;
+
+    for (uint16_t i = 0; i < 256; ++i) {
+        if (lengths[i] == 0)
+            continue;
+
+        ++counter;
+        last = i;
+        if (lengths[i] > max_length)
+            max_length = lengths[i];
+    }
+
+    uint64_t nibbles_size = 2 + (last + 2) / 2;
+    uint64_t bitmap_size  = 1 + 32 + counter;
+
+    /* Lengths of all characters up to the last used one, two per byte.  */
+    if (max_length <= 15 && nibbles_size <= bitmap_size) {
+        out[0] = HUFFMAN_LENGTHS_NIBBLES;
+        out[1] = last;
+        memset(out + 2, 0, nibbles_size - 2);
+
+        for (uint16_t i = 0; i <= last; ++i)
+            out[2 + i / 2] |= lengths[i] << (i % 2 == 0 ? 4 : 0);
+
+        return nibbles_size;
+    }
+
+    /* Bitmap of used characters followed by their lengths.  */
+    out[0] = HUFFMAN_LENGTHS_BITMAP;
+    memset(out + 1, 0, 32);
+
+    uint64_t k = 33;
+    for (uint16_t i = 0; i < 256; ++i) {
+        if (lengths[i] == 0)
+            continue;
+
+        out[1 + i / 8] |= 1 << (7 - i % 8);
+        out[k++] = lengths[i];
+    }
+
+    return bitmap_size;
+}
+
+
+static uint64_t
+_read_code_lengths(uint8_t const * in, uint64_t size, uint8_t * lengths) {
+    memset(lengths, 0, 256);
+
+    if (size < 2)
+        return 0;
+
+    if (in[0] == HUFFMAN_LENGTHS_NIBBLES) {
+        uint16_t last = in[1];
+        uint64_t nibbles_size = 2 + (last + 2) / 2;
+        if (size < nibbles_size)
+            return 0;
+
+        for (uint16_t i = 0; i <= last; ++i)
+            lengths[i] = (in[2 + i / 2] >> (i % 2 == 0 ? 4 : 0)) & 15;
+
+        return nibbles_size;
+    }
+
+    if (in[0] == HUFFMAN_LENGTHS_BITMAP && size >= 33) {
+        uint64_t k = 33;
+        for (uint16_t i = 0; i < 256; ++i) {
+            if (!(in[1 + i / 8] & (1 << (7 - i % 8))))
+                continue;
+
+            if (k == size)
+                return 0;
+
+            lengths[i] = in[k++];
+        }
+
+        return k;
+    }
+
+    return 0;
+}
+
+
+static char *
+_cast_prefix_code_to_cstring(uint64_t code, uint8_t length) {
+    char * char_code = calloc(length + 1, sizeof(char));
+
+    for (uint16_t j = 0; j < length; ++j)
+        char_code[j] = (code >> (length - 1 - j)) & 1 ? '1' : '0';
+
+    char_code[length] = '\0';
+
+    return char_code;
+}
+
+
+static bool
+_build_decode_table(uint8_t const * lengths, struct _decode_table * table) {
+    /* Codes that do not fit into the bit reader window can not be
+     * decoded with a single peek.  */
+    uint16_t numbers[HUFFMAN_MAX_DECODE_LENGTH + 1] = { 0 };
+    for (uint16_t i = 0; i < 256; ++i) {
+        if (lengths[i] > HUFFMAN_MAX_DECODE_LENGTH)
+            return false;
+
+        ++numbers[lengths[i]];
+    }
+
+    /* Codes are assigned exactly as in _assign_canonical_codes. The list of
+     * codes is sorted by length and then by character, which is the order
+     * of their left-aligned values.  */
+    uint64_t next_codes[HUFFMAN_MAX_DECODE_LENGTH + 1];
+    uint16_t positions[HUFFMAN_MAX_DECODE_LENGTH + 1];
+    uint64_t next_code = 0;
+    uint16_t position = 0;
+    numbers[0] = 0;
+
+    table->max_length = 0;
+
+    for (uint8_t length = 1; length <= HUFFMAN_MAX_DECODE_LENGTH; ++length) {
+        next_code = (next_code + numbers[length - 1]) << 1;
+        next_codes[length]  = next_code;
+        positions[length]   = position;
+        position += numbers[length];
+
+        if (numbers[length] == 0)
+            continue;
+
+        /* Code lengths that do not fit a binary tree.  */
+        if ((next_code + numbers[length] - 1) >> length != 0)
+            return false;
+
+        table->max_length = length;
+    }
+
+    table->size = position;
+    if (table->size == 0)
+        return false;
+
+    for (uint16_t i = 0; i < 256; ++i) {
+        uint8_t length = lengths[i];
+        if (length == 0)
+            continue;
+
+        struct _long_code * c = table->codes + positions[length]++;
+        c->start    = next_codes[length]++ << (64 - length);
+        c->length   = length;
+        c->symbol   = i;
+    }
+
+    table->bits = table->max_length <= HUFFMAN_MAX_TABLE_BITS
+        ? table->max_length
+        : HUFFMAN_TABLE_BITS;
+
+    memset(table->primary, 0,
+        ((size_t)1 << table->bits) * sizeof(struct _decode_entry));
+
+    /* Each code not longer than table bits occupies all primary entries
+     * that start with it. Entries of longer codes keep zero length and are
+     * resolved by the search over sorted codes.  */
+    for (uint16_t i = 0; i < table->size; ++i) {
+        if (table->codes[i].length > table->bits)
+            continue;
+
+        uint32_t first = table->codes[i].start >> (64 - table->bits);
+        uint32_t count = 1 << (table->bits - table->codes[i].length);
+
+        for (uint32_t k = first; k < first + count; ++k) {
+            table->primary[k].symbol = table->codes[i].symbol;
+            table->primary[k].length = table->codes[i].length;
+        }
+    }
+
+    return true;
+}
+
+
+static struct _long_code const *
+_find_long_code(struct _decode_table const * table, uint64_t window) {
+    /* Find the last code which start is not greater than window.  */
+    uint16_t l = 0, r = table->size;
+    while (r - l > 1) {
+        uint16_t m = (l + r) / 2;
+        if (table->codes[m].start <= window)
+            l = m;
+        else
+            r = m;
+    }
+
+    struct _long_code const * c = table->codes + l;
+    if (table->size == 0 || c->start > window
+            || (window - c->start) >> (64 - c->length) != 0)
+        return NULL;
+
+    return c;
+}
+
+
+static HUFFMAN_INLINE uint64_t
+_load_be64(uint8_t const * p) {
+    uint64_t word = 0;
+
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* Compilers do not always see the loop below is a single load.  */
+    memcpy(&word, p, 8);
+    word = __builtin_bswap64(word);
+#else
+    for (uint8_t i = 0; i < 8; ++i)
+        word = (word << 8) | p[i];
+#endif
+
+    return word;
+}
+
+
+static HUFFMAN_INLINE void
+_store_be64(uint8_t * p, uint64_t word) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+    memcpy(p, &word, 8);
+#else
+    for (uint8_t i = 0; i < 8; ++i)
+        p[i] = word >> (56 - 8 * i);
+#endif
+}
+
+
+static HUFFMAN_INLINE void
+_put_bits(struct _bit_writer * w, uint64_t code, uint8_t length) {
+    w->bits  |= code << (64 - w->count - length);
+    w->count += length;
+}
+
+
+static HUFFMAN_INLINE void
+_flush_bits(struct _bit_writer * w) {
+    uint8_t bytes = w->count >> 3;
+
+    if (w->end - w->next >= 8)
+        _store_be64(w->next, w->bits);
+
+    /* Near the end of output whole bytes are stored one by one.  */
+    else
+        for (uint8_t i = 0; i < bytes && w->next + i < w->end; ++i)
+            w->next[i] = w->bits >> (56 - 8 * i);
+
+    w->next  += bytes;
+    w->bits  <<= 8 * bytes;
+    w->count &= 7;
+}
+
+
+static uint64_t
+_finish_bits(struct _bit_writer * w) {
+    _flush_bits(w);
+
+    /* Last byte is padded with zero bits. Like in _flush_bits the position
+     * moves on even if there is no room, so that overflow can be seen.  */
+    if (w->count != 0) {
+        if (w->next < w->end)
+            *w->next = w->bits >> 56;
+
+        ++w->next;
+        w->bits  = 0;
+        w->count = 0;
+    }
+
+    return w->next - w->begin;
+}
+
+
+static HUFFMAN_INLINE void
+_refill(struct _bit_reader * r) {
+    if (r->end - r->next < 8) {
+        _refill_tail(r);
+        return;
+    }
+
+    uint64_t word = _load_be64(r->next);
+
+    r->bits  |= word >> r->count;
+    r->next  += (63 - r->count) >> 3;
+    r->count |= 56;
+}
+
+
+static void
+_refill_tail(struct _bit_reader * r) {
+    /* Near the end of input the missing bytes are read as zeros.  */
+    while (r->count <= 56) {
+        uint64_t byte = 0;
+        if (r->next < r->end)
+            byte = *r->next++;
+        else
+            ++r->overrun;
+
+        r->bits  |= byte << (56 - r->count);
+        r->count += 8;
+    }
+}
+
+
+static HUFFMAN_INLINE void
+_encode_using_table(uint8_t const * src, size_t n,
+    struct _encode_entry const * table, uint8_t max_length,
+    struct _bit_writer * w)
+{
+    /* After flush at most 7 bits stay in the accumulator, so the next
+     * per_flush codes always fit into 63 bits and at most 7 whole bytes
+     * are flushed at once.  */
+    uint8_t per_flush = 56 / max_length;
+    size_t i = 0;
+
+    while (n - i >= per_flush) {
+        for (uint8_t k = 0; k < per_flush; ++k) {
+            struct _encode_entry e = table[src[i++]];
+            _put_bits(w, e.code, e.length);
+        }
+
+        _flush_bits(w);
+    }
+
+    while (i < n) {
+        struct _encode_entry e = table[src[i++]];
+        _put_bits(w, e.code, e.length);
+        _flush_bits(w);
+    }
+}
+
+
+static HUFFMAN_INLINE bool
+_decode_using_table(uint8_t const * src, size_t n, uint8_t * dst,
+    size_t size, struct _decode_table const * table)
+{
+    struct _bit_reader r;
+    _init_reader(&r, src, n);
+
+    if (!_decode_symbols(&r, dst, size, table))
+        return false;
+
+    /* Codes must not run into zeros read past the end of input.  */
+    return r.overrun * 8 <= r.count;
+}
 
-    struct _huffman_tree_node * left;
-    struct _huffman_tree_node * right;
-};
 
+static HUFFMAN_INLINE bool
+_decode_interleaved(uint8_t const * const * src, size_t const * n,
+    uint8_t * dst, size_t size, struct _decode_table const * table)
+{
+    struct _bit_reader r[HUFFMAN_STREAMS];
+    for (uint8_t k = 0; k < HUFFMAN_STREAMS; ++k)
+        _init_reader(r + k, src[k], n[k]);
+
+    size_t segment = size / HUFFMAN_STREAMS;
+    uint8_t per_refill = 56 / table->max_length;
+    size_t i = 0;
+
+    /* Streams do not depend on each other, so decoding them in lockstep
+     * lets the processor work on all of them at once.  */
+    while (segment - i >= per_refill) {
+        for (uint8_t k = 0; k < HUFFMAN_STREAMS; ++k)
+            _refill(r + k);
+
+        for (uint8_t j = 0; j < per_refill; ++j, ++i)
+            for (uint8_t k = 0; k < HUFFMAN_STREAMS; ++k)
+                if (!_decode_symbol(r + k, table, dst + k * segment + i))
+                    return false;
+    }
 
-struct _heap {
-    struct _huffman_tree_node ** data;
-    uint64_t size, max_size;
-};
+    /* The rest of each stream, the last one is a bit longer.  */
+    for (uint8_t k = 0; k < HUFFMAN_STREAMS; ++k) {
+        size_t count = k + 1 < HUFFMAN_STREAMS ? segment : size - k * segment;
 
+        if (!_decode_symbols(r + k, dst + k * segment + i, count - i, table))
+            return false;
+
+        if (r[k].overrun * 8 > r[k].count)
+            return false;
+    }
+
+    return true;
+}
 
-struct huffman_tree *
-huffman(char const * string) {
-    struct _heap * h = _count_char_frequencies(string);
 
-    while(h->size > 1) {
-        struct _huffman_tree_node * l = _extract_minimum(h);
-        struct _huffman_tree_node * r = _extract_minimum(h);
+static HUFFMAN_INLINE void
+_init_reader(struct _bit_reader * r, uint8_t const * src, size_t n) {
+    r->next     = src;
+    r->end      = src + n;
+    r->bits     = 0;
+    r->count    = 0;
+    r->overrun  = 0;
+}
+
+
+static HUFFMAN_INLINE bool
+_decode_symbol(struct _bit_reader * r, struct _decode_table const * table,
+    uint8_t * symbol)
+{
+    struct _decode_entry e = table->primary[r->bits >> (64 - table->bits)];
 
-        struct _huffman_tree_node * s = \
-            _create_huffman_tree_node('\0', l->value + r->value, false);
-        s->left = l; s->right = r;
+    if (e.length == 0) {
+        struct _long_code const * c = _find_long_code(table, r->bits);
+        if (c == NULL)
+            return false;
 
-        _insert(h, s);
+        e.symbol = c->symbol;
+        e.length = c->length;
     }
 
-    struct huffman_tree * t = _create_huffman_tree(_minimum(h));
-    free(h->data);
-    free(h);
+    *symbol  = e.symbol;
+    r->bits  <<= e.length;
+    r->count -= e.length;
 
-    return t;
+    return true;
 }
 
 
-uint8_t const *
-compress_huffman(char const * str, uint64_t * size, uint8_t ** a) {
-    struct huffman_tree * t = huffman(str);
+static HUFFMAN_INLINE bool
+_decode_symbols(struct _bit_reader * r, uint8_t * dst, size_t size,
+    struct _decode_table const * table)
+{
+    /* After refill there are at least 56 bits in the buffer, which is
+     * enough for several codes of maximal length.  */
+    uint8_t per_refill = 56 / table->max_length;
+    size_t i = 0;
 
-    uint8_t memb_size = height(t) / 8 + 1;
-    uint8_t ** codes;
+    while (i < size) {
+        _refill(r);
 
-    _get_huffman_codes(t->root, &codes, NULL, 0, memb_size);
+        for (uint8_t k = 0; k < per_refill && i < size; ++k)
+            if (!_decode_symbol(r, table, dst + i++))
+                return false;
+    }
 
-    uint64_t * frequencies = get_char_frequencies(t);
+    return true;
+}
 
-    uint8_t counter = 0;
-    for (uint16_t i = 0; i < 256; ++i)
-        if (frequencies[i] != 0) ++counter;
 
-    /* Period - number of bytes needed to store both ascii and prefix codes
-     * of one character.  */
-    uint8_t     period          = memb_size + 1;
-    uint32_t    alphabet_size   = 2 + counter * period;
+static bool
+_decode_slice(uint8_t const * src, size_t n, size_t skip, uint8_t * dst,
+    size_t size, struct _decode_table const * table,
+    struct _context_model const * model)
+{
+    struct _bit_reader r;
+    _init_reader(&r, src, n);
+
+    /* Codes do not tell where a symbol starts, so the skipped ones are
+     * decoded and dropped. Each stream starts in context 0.  */
+    uint8_t scratch[256];
+    uint8_t previous = 0;
+    while (skip > 0) {
+        size_t count = skip < sizeof(scratch) ? skip : sizeof(scratch);
+        if (model != NULL
+                ? !_decode_context_symbols(&r, scratch, count, model,
+                    &previous)
+                : !_decode_symbols(&r, scratch, count, table))
+            return false;
+
+        skip -= count;
+    }
 
-    /* First 2 bytes are used to store number of characters in alphabet and
-     * number of bytes used to store prefix code for one character.  */
-    uint8_t * alphabet = calloc(alphabet_size, 1);
-    alphabet[0] = counter; alphabet[1] = memb_size;
+    if (model != NULL
+            ? !_decode_context_symbols(&r, dst, size, model, &previous)
+            : !_decode_symbols(&r, dst, size, table))
+        return false;
 
-    uint8_t k = 0;
-    for (uint16_t i = 0; i < 256; ++i) {
-        if (frequencies[i] == 0)
-            continue;
+    return r.overrun * 8 <= r.count;
+}
 
-        alphabet[2 + k * period] = i;
-        for (size_t j = 0; j < memb_size; ++j)
-            alphabet[k * period + 3 + j] = codes[i][j];
-        ++k;
+
+static size_t
+_stream_count(uint8_t type, size_t n, size_t interval, size_t * segment) {
+    if (type & HUFFMAN_BLOCK_SYNC) {
+        *segment = interval;
+        return (n - 1) / interval + 1;
     }
 
-    *a = alphabet;
+    if (type & HUFFMAN_BLOCK_INTERLEAVED) {
+        *segment = n / HUFFMAN_STREAMS;
+        return HUFFMAN_STREAMS;
+    }
 
-    /* At first we allocate for compressed string the same amount of memory
-     * it takes to store raw string.  */
-    uint8_t * compressed_string = calloc(strlen(str), 1);
+    *segment = n;
+    return 1;
+}
 
-    uint8_t shift = 0;
-    /* Compressed size equals to number of fully used bytes (that have all
-     * bits set).  */
-    uint64_t raw_index = 0, compressed_size = 0;
 
-    while(str[raw_index] != '\0') {
-        uint8_t * code          = codes[str[raw_index++]];
-        uint8_t * shifted_code  = calloc(memb_size + 1, 1);                        
-        for (uint16_t i = 0; i < memb_size; ++i)
-            *(shifted_code + i) = *(code + i);
+static size_t
+_streams_overhead(uint8_t type, size_t n, size_t interval,
+    uint8_t max_length)
+{
+    size_t segment;
+    size_t streams = _stream_count(type, n, interval, &segment);
+    if (streams == 1)
+        return 0;
 
-        for (uint8_t i = memb_size; i > 0; --i) {
-            for (uint8_t j = 0; j < shift; ++j) {
-                shifted_code[i] >>= 1;
+    uint8_t buffer[HUFFMAN_MAX_VARINT_SIZE];
+    size_t interval_size = type & HUFFMAN_BLOCK_SYNC
+        ? _write_varint(buffer, interval) : 0;
 
-                if (shifted_code[i - 1] & (1 << j))
-                    shifted_code[i] ^= 128;
-            }
-        }
-        
-        shifted_code[0] >>= shift;
+    return interval_size
+        + (_stream_size_width(segment, max_length) + 1) * (streams - 1);
+}
+
+
+static size_t
+_encode_streams(uint8_t const * src, size_t n,
+    struct _encode_entry const * table, uint8_t max_length, uint8_t type,
+    size_t interval, uint8_t * out, size_t cap,
+    struct _context_model const * model)
+{
+    size_t segment;
+    size_t streams = _stream_count(type, n, interval, &segment);
+
+    uint8_t header[HUFFMAN_MAX_VARINT_SIZE];
+    size_t header_size = type & HUFFMAN_BLOCK_SYNC
+        ? _write_varint(header, interval) : 0;
+
+    /* Stream sizes are known after coding, so room for them is reserved
+     * before the streams.  */
+    uint8_t width = streams > 1 ? _stream_size_width(segment, max_length) : 0;
+    uint8_t * sizes = out + header_size;
+
+    if (cap < header_size + width * (streams - 1))
+        return HUFFMAN_ERROR;
 
-        for (uint16_t i = 0; i <= memb_size; ++i)
-            compressed_string[compressed_size++] ^= shifted_code[i];
+    memcpy(out, header, header_size);
 
-        while(compressed_string[compressed_size] == 0)
-            --compressed_size;
-        
-        uint8_t length = _get_prefix_code_length(code, memb_size);
+    struct _bit_writer w;
+    w.next  = sizes + width * (streams - 1);
+    w.end   = out + cap;
+    w.bits  = 0;
+    w.count = 0;
 
-        shift = (length + shift) % 8;
-        compressed_string[compressed_size] ^= 1 << (7 - shift);
-        
-        free(shifted_code);
+    for (size_t k = 0; k < streams; ++k) {
+        size_t count = k + 1 < streams ? segment : n - k * segment;
+
+        w.begin = w.next;
+        if (model != NULL)
+            _encode_context(src + k * segment, count, model, &w);
+        else
+            _kernels[_kernel].encode(src + k * segment, count, table,
+                max_length, &w);
+
+        uint64_t stream_size = _finish_bits(&w);
+        if (k + 1 < streams)
+            for (uint8_t j = 0; j < width; ++j)
+                sizes[k * width + j] = stream_size >> (8 * j);
     }
 
-    if (shift != 0) ++compressed_size;
+    if (w.next > w.end)
+        return HUFFMAN_ERROR;
+
+    return w.next - out;
+}
 
-    uint8_t * compressed_string_2 = calloc(compressed_size, 1);
-    for (uint64_t i = 0; i < compressed_size; ++i)
-        compressed_string_2[i] = compressed_string[i];
 
-    *size = compressed_size;
+static bool
+_read_layout(uint8_t type, uint8_t const * in, size_t n, size_t size,
+    uint8_t max_length, struct _stream_layout * layout)
+{
+    uint8_t flags = type & ~HUFFMAN_BLOCK_TYPE_MASK;
+    if (flags != 0 && flags != HUFFMAN_BLOCK_INTERLEAVED
+            && flags != HUFFMAN_BLOCK_SYNC)
+        return false;
+
+    /* Block of one interval or less would have no sync points.  */
+    uint64_t interval = 0;
+    size_t header_size = 0;
+    if (flags == HUFFMAN_BLOCK_SYNC) {
+        header_size = _read_varint(in, n, &interval);
+        if (header_size == 0 || interval < HUFFMAN_MIN_SYNC_INTERVAL
+                || interval >= size)
+            return false;
+    }
 
-    /* Deallocating memory.  */
-    free(t);
+    layout->streams = _stream_count(type, size, interval, &layout->segment);
+    layout->width   = layout->streams > 1
+        ? _stream_size_width(layout->segment, max_length) : 0;
 
-    for (uint16_t i = 0; i < 256; ++i)
-        free(codes[i]);
+    /* Sizes of all streams but the last one, which takes the rest.  */
+    size_t sizes_size = layout->width * (layout->streams - 1);
+    if (n - header_size < sizes_size)
+        return false;
 
-    free(codes);
-    free(frequencies);
-    free(compressed_string);
+    layout->next    = 0;
+    layout->sizes   = in + header_size;
+    layout->data    = layout->sizes + sizes_size;
+    layout->left    = n - header_size - sizes_size;
 
-    return compressed_string_2;
+    return true;
 }
 
 
-char *
-decompress_huffman(uint8_t const * compressed_string,
-    uint64_t size, uint8_t * alphabet)
+static bool
+_next_stream(struct _stream_layout * layout, uint8_t const ** stream,
+    size_t * n)
 {
-    struct huffman_tree * t = _restore_huffman_tree(alphabet);
-    return _decompress_huffman_using_tree(compressed_string, size, t);
+    size_t k = layout->next++;
+    uint64_t stream_size = layout->left;
+
+    if (k + 1 < layout->streams) {
+        stream_size = 0;
+        for (uint8_t j = 0; j < layout->width; ++j)
+            stream_size |= (uint64_t)layout->sizes[k * layout->width + j]
+                << (8 * j);
+
+        if (stream_size > layout->left)
+            return false;
+    }
+
+    *stream = layout->data;
+    *n      = stream_size;
+    layout->data += stream_size;
+    layout->left -= stream_size;
+
+    return true;
 }
 
 
-uint64_t *
-get_char_frequencies(struct huffman_tree * t) {
-    uint64_t * counts = calloc(256, 8);  /* Alphabet size.  */
-    _infix_traverse(t->root, counts);
+static bool
+_decode_streams(uint8_t type, uint8_t const * in, size_t n, uint8_t * dst,
+    size_t size, struct _decode_table const * table,
+    struct _context_model const * model)
+{
+    struct _stream_layout layout;
+    if (!_read_layout(type, in, n, size,
+            model != NULL ? model->max_length : table->max_length, &layout))
+        return false;
+
+    if (layout.streams == 1)
+        return model != NULL
+            ? _decode_slice(layout.data, layout.left, 0, dst, size, NULL,
+                model)
+            : _kernels[_kernel].decode(layout.data, layout.left, dst, size,
+                table);
+
+    /* Streams are decoded HUFFMAN_STREAMS at once as long as they split
+     * their part of dst the way the interleaved decoder does.  */
+    size_t segment = layout.segment;
+    size_t k = 0;
+
+    while (layout.streams - k >= HUFFMAN_STREAMS) {
+        size_t group_size = k + HUFFMAN_STREAMS < layout.streams
+            ? HUFFMAN_STREAMS * segment : size - k * segment;
+        if (group_size / HUFFMAN_STREAMS != segment)
+            break;
+
+        uint8_t const * streams[HUFFMAN_STREAMS];
+        size_t stream_sizes[HUFFMAN_STREAMS];
+
+        for (uint8_t j = 0; j < HUFFMAN_STREAMS; ++j)
+            if (!_next_stream(&layout, streams + j, stream_sizes + j))
+                return false;
+
+        if (model != NULL
+                ? !_decode_context_interleaved(streams, stream_sizes,
+                    dst + k * segment, group_size, model)
+                : !_kernels[_kernel].decode_interleaved(streams, stream_sizes,
+                    dst + k * segment, group_size, table))
+            return false;
+
+        k += HUFFMAN_STREAMS;
+    }
 
-    return counts;
+    for (; k < layout.streams; ++k) {
+        size_t count = k + 1 < layout.streams ? segment : size - k * segment;
+
+        uint8_t const * stream;
+        size_t stream_size;
+        if (!_next_stream(&layout, &stream, &stream_size))
+            return false;
+
+        if (model != NULL
+                ? !_decode_slice(stream, stream_size, 0, dst + k * segment,
+                    count, NULL, model)
+                : !_kernels[_kernel].decode(stream, stream_size,
+                    dst + k * segment, count, table))
+            return false;
+    }
+
+    return true;
 }
 
 
-char **
-get_huffman_codes(struct huffman_tree * t, char ** chars, uint8_t * size, 
-    uint8_t * memb_size)
+static bool
+_decode_streams_range(uint8_t type, uint8_t const * in, size_t n,
+    size_t size, size_t offset, size_t length, uint8_t * dst,
+    struct _decode_table const * table, struct _context_model const * model)
 {
-    /* Memory used to store prefix code for a character always has free space
-     * (from 1 to 8 bits) to store 1 in it as a separator between valid
-     * prefix code and "junk" bits.  */
-    *memb_size = height(t) / 8 + 1;
-    uint8_t ** codes = NULL;
+    struct _stream_layout layout;
+    if (!_read_layout(type, in, n, size,
+            model != NULL ? model->max_length : table->max_length, &layout))
+        return false;
 
-    _get_huffman_codes(t->root, &codes, NULL, 0, *memb_size);
-    
-    *size = 0;
-    for (uint16_t i = 0; i < 256; ++i)
-        if (codes[i] != NULL) ++(*size);
-    
-    *chars = calloc(*size, sizeof(char));
-    char ** codes_strings = calloc(*size, sizeof(char *));
+    /* Streams before the slice are only stepped over by their sizes.  */
+    size_t segment = layout.segment;
+    size_t end = offset + length;
 
-    uint8_t index = 0;
-    for (uint16_t i = 0; i < 256; ++i) 
-        if (codes[i] != NULL) {
-            (*chars)[index] = (char)i;
+    for (size_t k = 0; k < layout.streams; ++k) {
+        size_t first = k * segment;
+        size_t last  = k + 1 < layout.streams ? first + segment : size;
 
-            codes_strings[index++] = \
-                _cast_prefix_code_to_cstring(codes[i], *memb_size);
-        }
+        if (first >= end)
+            break;
 
-    return codes_strings;
+        uint8_t const * stream;
+        size_t stream_size;
+        if (!_next_stream(&layout, &stream, &stream_size))
+            return false;
+
+        if (last <= offset)
+            continue;
+
+        size_t from = offset > first ? offset : first;
+        size_t to   = end < last ? end : last;
+
+        if (!_decode_slice(stream, stream_size, from - first,
+                dst + (from - offset), to - from, table, model))
+            return false;
+    }
+
+    return true;
 }
 
 
-uint8_t
-height(struct huffman_tree * t) {
-    return _height(t->root);
+static bool
+_ensure_model(struct huffman_ctx * ctx) {
+    if (ctx->model != NULL)
+        return true;
+
+    ctx->model = malloc(sizeof(struct _context_model));
+    HUFFMAN_STATS_ADD(ctx->stats, allocations, ctx->model != NULL);
+
+    return ctx->model != NULL;
 }
 
 
 static void
-_heapify_nondesc(struct _heap * q, uint64_t i) {
-    if (q->size == 0)
-        return;
-        
-    uint64_t smallest = i;
-    uint64_t l = i * 2 + 1;
-    uint64_t r = i * 2 + 2;
+_count_contexts(uint8_t const * src, size_t n, uint8_t type,
+    size_t interval, struct _context_model * model)
+{
+    memset(model->counts, 0, sizeof(model->counts));
+
+    size_t segment;
+    size_t streams = _stream_count(type, n, interval, &segment);
 
-    if (l < q->size)
-        if (q->data[l]->value < q->data[i]->value)
-            smallest = l;
+    for (size_t k = 0; k < streams; ++k) {
+        uint8_t const * stream = src + k * segment;
+        size_t count = k + 1 < streams ? segment : n - k * segment;
 
-    if (r < q->size)
-        if (q->data[r]->value < q->data[smallest]->value)
-            smallest = r;
-        
-    if (smallest != i) {
-        _swap(q->data[i], q->data[smallest]);
-        _heapify_nondesc(q, smallest);
+        uint8_t previous = 0;
+        for (size_t i = 0; i < count; ++i) {
+            ++model->counts[previous][stream[i]];
+            previous = stream[i];
+        }
     }
 }
 
 
-static struct _huffman_tree_node *
-_minimum(struct _heap * q) {
-    return q->data[0];
-}
+static uint64_t
+_cluster_contexts(struct _context_model * model, uint8_t clusters,
+    uint8_t max_code_length, struct huffman_tree * t)
+{
+    /* Contexts that occur, most frequent first.  */
+    uint64_t totals[256];
+    uint8_t contexts[256];
+    uint16_t used = 0;
 
+    for (uint16_t c = 0; c < 256; ++c) {
+        totals[c] = 0;
+        for (uint16_t j = 0; j < 256; ++j)
+            totals[c] += model->counts[c][j];
 
-static struct _huffman_tree_node *
-_extract_minimum(struct _heap * q) {
-    if (q->size < 1)
-        return NULL;
+        if (totals[c] == 0)
+            continue;
 
-    struct _huffman_tree_node * min = q->data[0];
-    q->data[0] = q->data[q->size - 1];  // What if there is only one element left?
-    q->size = q->size - 1;
-    _heapify_nondesc(q, 0);
-    return min;
-}
+        uint16_t i = used++;
+        for (; i > 0 && totals[contexts[i - 1]] < totals[c]; --i)
+            contexts[i] = contexts[i - 1];
 
+        contexts[i] = c;
+    }
 
-static void
-_insert(struct _heap * h, struct _huffman_tree_node * n) {
-    /* If there is no more free space in heap - allocate new memory.  */
-    if (h->size == h->max_size) {
-        struct _huffman_tree_node ** new_data = \
-            calloc(2 * h->size, sizeof(struct _huffman_tree_node *));
+    /* The most frequent contexts seed the clusters, each of the others
+     * then moves to the cluster whose codes take fewest bits for it, and
+     * codes follow the new clusters.  */
+    uint8_t seeds = used < clusters ? used : clusters;
+    memset(model->map, 0, 256);
+    for (uint16_t i = 0; i < seeds; ++i)
+        model->map[contexts[i]] = i;
+
+    bool moved = true;
+    for (uint8_t round = 0; ; ++round) {
+        memset(model->cluster_counts, 0, sizeof(model->cluster_counts));
+        for (uint16_t i = 0; i < (round == 0 ? seeds : used); ++i) {
+            uint64_t * counts = model->cluster_counts[model->map[contexts[i]]];
+            for (uint16_t j = 0; j < 256; ++j)
+                counts[j] += model->counts[contexts[i]][j];
+        }
+
+        /* Counts always follow the last move, so that every byte of a
+         * context has a code in its cluster.  */
+        if (seeds == used
+                || (round > 0 && (!moved || round >= HUFFMAN_CLUSTER_ROUNDS)))
+            break;
+
+        /* Bytes absent from a cluster are charged a bit more than its
+         * rarest ones. Bits of a byte in all clusters are together, so
+         * that each context is scanned once. They are kept in the model,
+         * as they would take much of a small thread stack.  */
+        double (* bits)[HUFFMAN_MAX_CLUSTERS] = model->bits;
+        memset(model->bits, 0, sizeof(model->bits));
+        for (uint8_t k = 0; k < seeds; ++k) {
+            uint64_t total = 0;
+            for (uint16_t j = 0; j < 256; ++j)
+                total += model->cluster_counts[k][j];
+
+            double total_bits = log2(total + 1.0);
+            for (uint16_t j = 0; j < 256; ++j)
+                bits[j][k] = total_bits
+                    - log2(model->cluster_counts[k][j] + 0.5);
+        }
+
+        moved = false;
+        for (uint16_t i = 0; i < used; ++i) {
+            uint32_t const * counts = model->counts[contexts[i]];
+            double costs[HUFFMAN_MAX_CLUSTERS] = { 0 };
+
+            for (uint16_t j = 0; j < 256; ++j)
+                if (counts[j] != 0)
+                    for (uint8_t k = 0; k < HUFFMAN_MAX_CLUSTERS; ++k)
+                        costs[k] += counts[j] * bits[j][k];
+
+            uint8_t best = 0;
+            for (uint8_t k = 1; k < seeds; ++k)
+                if (costs[k] < costs[best])
+                    best = k;
 
-        for (uint64_t i = 0; i < h->size; ++i)
-            new_data[i] = h->data[i];
-        
-        free(h->data);
-        h->data = new_data;
+            moved |= model->map[contexts[i]] != best;
+            model->map[contexts[i]] = best;
+        }
     }
 
-    /* Proceed insertion.  */
-    h->size += 1;
-    h->data[h->size - 1] = n;
+    /* Clusters left without contexts are dropped, contexts that do not
+     * occur go to the first cluster.  */
+    uint8_t numbers[HUFFMAN_MAX_CLUSTERS];
+    model->clusters = 0;
+    for (uint8_t k = 0; k < seeds; ++k) {
+        bool empty = true;
+        for (uint16_t j = 0; j < 256 && empty; ++j)
+            empty = model->cluster_counts[k][j] == 0;
+
+        if (empty)
+            continue;
 
-    uint64_t i = h->size - 1;
-    uint64_t parent_index = (i - 1) / 2;
+        numbers[k] = model->clusters;
+        if (model->clusters != k)
+            memcpy(model->cluster_counts[model->clusters],
+                model->cluster_counts[k], sizeof(model->cluster_counts[k]));
 
-    while (i > 0 && h->data[parent_index]->value > h->data[i]->value)
-    {
-        _swap(h->data[parent_index], h->data[i]);
-        i = parent_index;
-        parent_index = (i - 1) / 2;
+        ++model->clusters;
     }
-}
 
+    for (uint16_t c = 0; c < 256; ++c)
+        model->map[c] = totals[c] != 0 ? numbers[model->map[c]] : 0;
 
-static struct _heap *
-_initialize_heap() {
-    struct _heap * h = calloc(1, sizeof(struct _heap));
-    h->data = calloc(DEFAULT_HEAP_SIZE, 
-        sizeof(struct _huffman_tree_node *));
-    h->max_size = DEFAULT_HEAP_SIZE; h->size = 0;
+    uint64_t bits = 0;
+    model->max_length = 0;
 
-    return h;
+    for (uint8_t k = 0; k < model->clusters; ++k) {
+        _build_huffman_tree(t, model->cluster_counts[k]);
+        _limit_code_lengths(t, max_code_length);
+
+        uint8_t length = _get_code_lengths(t, model->lengths[k]);
+        if (length > model->max_length)
+            model->max_length = length;
+
+        for (uint16_t j = 0; j < 256; ++j)
+            bits += model->cluster_counts[k][j] * model->lengths[k][j];
+    }
+
+    return (bits + 7) / 8;
 }
 
 
-static struct _huffman_tree_node *
-_create_huffman_tree_node(char key, uint64_t value, bool is_leaf) {
-    struct _huffman_tree_node * n = \
-        calloc(1, sizeof(struct _huffman_tree_node));
+static size_t
+_compress_context(struct huffman_ctx * ctx, uint8_t const * src, size_t n,
+    uint8_t layout, size_t limit, uint8_t * dst, size_t cap)
+{
+
+    /* Counts by context are 32-bit. Without memory for the model blocks
+     * are coded with a single table.  */
+    if (n > UINT32_MAX || !_ensure_model(ctx))
+        return 0;
+
+    struct _context_model * model = ctx->model;
+    size_t interval = ctx->sync_interval;
+    uint8_t type = HUFFMAN_BLOCK_CONTEXT | layout;
+
+    /* Times are only added for blocks coded this way, the other ones count
+     * the attempt as building their table.  */
+    HUFFMAN_STATS_START(ctx->stats, histogram_start);
+    _count_contexts(src, n, type, interval, model);
+
+    HUFFMAN_STATS_START(ctx->stats, build_start);
+    uint8_t max_code_length = ctx->max_code_length < HUFFMAN_TABLE_BITS
+        ? ctx->max_code_length : HUFFMAN_TABLE_BITS;
+    uint64_t codes_size = _cluster_contexts(model, ctx->clusters,
+        max_code_length, &ctx->tree);
+
+    uint8_t header[HUFFMAN_MAX_CONTEXT_HEADER_SIZE];
+    size_t size = _write_varint(header, n);
+    header[size++] = type;
+    size += _write_context_model(model, header + size);
+
+    uint64_t coded_size = size + codes_size
+        + _streams_overhead(type, n, interval, model->max_length);
+    if (coded_size >= limit)
+        return 0;
+
+    if (cap < size)
+        return HUFFMAN_ERROR;
+
+    memcpy(dst, header, size);
+    _build_context_tables(model, true, false);
+
+    HUFFMAN_STATS_ADD(ctx->stats, histogram_ns, build_start - histogram_start);
+    HUFFMAN_STATS_TIME(ctx->stats, build_ns, build_start);
+    HUFFMAN_STATS_START(ctx->stats, encode_start);
 
-    n->key = key;
-    n->value = value;
-    n->is_leaf = is_leaf;
-    n->left = NULL; n->right = NULL;
+    size_t payload_size = _encode_streams(src, n, NULL, model->max_length,
+        type, interval, dst + size, cap - size, model);
+    if (payload_size == HUFFMAN_ERROR)
+        return HUFFMAN_ERROR;
 
-    return n;
+    HUFFMAN_STATS_TIME(ctx->stats, encode_ns, encode_start);
+    HUFFMAN_STATS_MAX(ctx->stats, max_code_length, model->max_length);
+    HUFFMAN_STATS_BLOCK(ctx->stats, HUFFMAN_BLOCK_CONTEXT, n,
+        size + payload_size, size);
+
+    return size + payload_size;
 }
 
 
-struct _heap *
-_count_char_frequencies(char const * string) {
-    uint64_t * counts = calloc(256, 8);
-    for (uint16_t j = 0; j < 256; ++j)
-        counts[j] = 0;
+static size_t
+_write_context_model(struct _context_model const * model, uint8_t * out) {
+    out[0] = model->clusters;
 
-    uint64_t i = 0;
-    while (string[i] != '\0')
-        counts[string[i++]] += 1;
+    /* Clusters of two contexts per byte, the first one in high bits.  */
+    for (uint16_t c = 0; c < 256; c += 2)
+        out[1 + c / 2] = model->map[c] << 4 | model->map[c + 1];
 
-    struct _heap * h = _initialize_heap();
+    size_t size = 1 + HUFFMAN_CLUSTER_MAP_SIZE;
+    for (uint8_t k = 0; k < model->clusters; ++k)
+        size += _write_code_lengths(model->lengths[k], out + size);
 
-    for (uint16_t j = 0; j < 256; ++j) {
-        if (counts[j] == 0)
-            continue;
+    return size;
+}
+
+
+static size_t
+_read_context_model(uint8_t const * in, size_t n,
+    struct _context_model * model)
+{
+    if (n < 1 + HUFFMAN_CLUSTER_MAP_SIZE)
+        return 0;
+
+    model->clusters = in[0];
+    if (model->clusters == 0 || model->clusters > HUFFMAN_MAX_CLUSTERS)
+        return 0;
+
+    for (uint16_t c = 0; c < 256; ++c) {
+        model->map[c] = (in[1 + c / 2] >> (c % 2 == 0 ? 4 : 0)) & 15;
+        if (model->map[c] >= model->clusters)
+            return 0;
+    }
 
-        struct _huffman_tree_node * n = \
-            _create_huffman_tree_node((char)j, counts[j], true);
+    size_t size = 1 + HUFFMAN_CLUSTER_MAP_SIZE;
+    for (uint8_t k = 0; k < model->clusters; ++k) {
+        size_t alphabet_size = _read_code_lengths(in + size, n - size,
+            model->lengths[k]);
+        if (alphabet_size == 0)
+            return 0;
 
-        _insert(h, n);
+        size += alphabet_size;
     }
 
-    return h;
+    return _build_context_tables(model, false, true) ? size : 0;
 }
 
 
-struct huffman_tree *
-_create_huffman_tree(struct _huffman_tree_node * n) {
-    struct huffman_tree * t = calloc(1, sizeof(struct huffman_tree));
-    t->root = n;
-    return t;
+static bool
+_build_context_tables(struct _context_model * model, bool encoding,
+    bool decoding)
+{
+    model->max_length = 0;
+
+    for (uint8_t k = 0; k < model->clusters; ++k) {
+        uint8_t const * lengths = model->lengths[k];
+
+        /* Codes fit the table if they take no more than all its entries.  */
+        uint32_t entries = 0;
+        for (uint16_t j = 0; j < 256; ++j) {
+            if (lengths[j] > HUFFMAN_TABLE_BITS)
+                return false;
+
+            if (lengths[j] != 0)
+                entries += (uint32_t)1 << (HUFFMAN_TABLE_BITS - lengths[j]);
+
+            if (lengths[j] > model->max_length)
+                model->max_length = lengths[j];
+        }
+
+        if (entries == 0 || entries > (uint32_t)1 << HUFFMAN_TABLE_BITS)
+            return false;
+
+        if (encoding)
+            _build_encode_table(lengths, model->encode_tables[k]);
+
+        /* Every entry starting with a code resolves it, the rest are left
+         * zero and rejected by the decoder.  */
+        if (decoding) {
+            struct _decode_entry * table = model->decode_tables[k];
+            memset(table, 0, sizeof(model->decode_tables[k]));
+
+            uint64_t codes[256];
+            _assign_canonical_codes(lengths, codes);
+
+            for (uint16_t j = 0; j < 256; ++j) {
+                if (lengths[j] == 0)
+                    continue;
+
+                uint8_t free_bits = HUFFMAN_TABLE_BITS - lengths[j];
+                uint32_t first = codes[j] << free_bits;
+                for (uint32_t i = 0; i < (uint32_t)1 << free_bits; ++i) {
+                    table[first + i].symbol = j;
+                    table[first + i].length = lengths[j];
+                }
+            }
+        }
+    }
+
+    for (uint16_t c = 0; c < 256; ++c) {
+        model->encode_by_context[c] = model->encode_tables[model->map[c]];
+        model->decode_by_context[c] = model->decode_tables[model->map[c]];
+    }
+
+    return true;
 }
 
 
-static void
-_infix_traverse(struct _huffman_tree_node * n, uint64_t * counts) {
-    if (n == NULL)
-        return;
+static HUFFMAN_INLINE void
+_encode_context(uint8_t const * src, size_t n,
+    struct _context_model const * model, struct _bit_writer * w)
+{
+    /* Same flushing as in _encode_using_table, each stream starts in
+     * context 0.  */
+    uint8_t per_flush = 56 / model->max_length;
+    uint8_t previous = 0;
+    size_t i = 0;
+
+    while (n - i >= per_flush) {
+        for (uint8_t k = 0; k < per_flush; ++k) {
+            struct _encode_entry const * table =
+                model->encode_by_context[previous];
+            _put_bits(w, table[src[i]].code, table[src[i]].length);
+            previous = src[i++];
+        }
 
-    if (n->left == NULL && n->right == NULL) {
-        counts[n->key] = n->value;   // Changed from size_t to int.
-        return;
+        _flush_bits(w);
     }
 
-    // printf("[\'%c\':%d]", n->key, n->value);
-    _infix_traverse(n->left, counts);
-    _infix_traverse(n->right, counts);    
+    while (i < n) {
+        struct _encode_entry e = model->encode_by_context[previous][src[i]];
+        _put_bits(w, e.code, e.length);
+        _flush_bits(w);
+        previous = src[i++];
+    }
 }
 
 
-static uint8_t
-_height(struct _huffman_tree_node * n) {
-    if (n->left == NULL && n->right == NULL)
-        return 0;
+static HUFFMAN_INLINE bool
+_decode_context_symbol(struct _bit_reader * r,
+    struct _context_model const * model, uint8_t * previous)
+{
+    struct _decode_entry e = model->decode_by_context[*previous]
+        [r->bits >> (64 - HUFFMAN_TABLE_BITS)];
+    if (e.length == 0)
+        return false;
 
-    return _height(n->left) > _height(n->right)
-        ? 1 + _height(n->left)
-        : 1 + _height(n->right);
+    *previous = e.symbol;
+    r->bits  <<= e.length;
+    r->count -= e.length;
+
+    return true;
 }
 
 
-static void
-_get_huffman_codes(struct _huffman_tree_node * n, uint8_t *** codes,
-    uint8_t * path, uint8_t depth, uint8_t memb_size)
-{    
-    if (depth == 0) {
-        *codes  = calloc(256, sizeof(uint8_t *));   // *codes = [NULL, NULL, NULL, ...]
-        path    = calloc(memb_size, 1);
+static HUFFMAN_INLINE bool
+_decode_context_symbols(struct _bit_reader * r, uint8_t * dst, size_t size,
+    struct _context_model const * model, uint8_t * previous)
+{
+    uint8_t per_refill = 56 / model->max_length;
+    size_t i = 0;
+
+    while (i < size) {
+        _refill(r);
+
+        for (uint8_t k = 0; k < per_refill && i < size; ++k) {
+            if (!_decode_context_symbol(r, model, previous))
+                return false;
+
+            dst[i++] = *previous;
+        }
     }
 
-    if (n->left == NULL && n->right == NULL) {
-        uint8_t * code = _copy_prefix_code(path, memb_size);
-        free(path);
-        (*codes)[n->key] = code;
+    return true;
+}
+
 
-        return;
+static bool
+_decode_context_interleaved(uint8_t const * const * src, size_t const * n,
+    uint8_t * dst, size_t size, struct _context_model const * model)
+{
+    struct _bit_reader r[HUFFMAN_STREAMS];
+    uint8_t previous[HUFFMAN_STREAMS];
+    for (uint8_t k = 0; k < HUFFMAN_STREAMS; ++k) {
+        _init_reader(r + k, src[k], n[k]);
+        previous[k] = 0;
     }
 
-    uint8_t * path_l = _copy_prefix_code(path, memb_size);
-    uint8_t * path_r = _copy_prefix_code(path, memb_size);
+    size_t segment = size / HUFFMAN_STREAMS;
+    uint8_t per_refill = 56 / model->max_length;
+    size_t i = 0;
 
-    _append_prefix_code(path_l, memb_size, depth, 0);
-    _append_prefix_code(path_r, memb_size, depth, 1);
+    /* Each table depends on the symbol before, so streams in lockstep are
+     * what keeps the processor busy.  */
+    while (segment - i >= per_refill) {
+        for (uint8_t k = 0; k < HUFFMAN_STREAMS; ++k)
+            _refill(r + k);
 
-    _get_huffman_codes(n->left, codes, path_l, ++depth, memb_size);
-    _get_huffman_codes(n->right, codes, path_r, depth, memb_size);
+        for (uint8_t j = 0; j < per_refill; ++j, ++i)
+            for (uint8_t k = 0; k < HUFFMAN_STREAMS; ++k) {
+                if (!_decode_context_symbol(r + k, model, previous + k))
+                    return false;
 
-    free(path);
-}
+                dst[k * segment + i] = previous[k];
+            }
+    }
 
+    for (uint8_t k = 0; k < HUFFMAN_STREAMS; ++k) {
+        size_t count = k + 1 < HUFFMAN_STREAMS ? segment : size - k * segment;
 
-static uint8_t *
-_copy_prefix_code(uint8_t * code, uint8_t memb_size) {
-    uint8_t * p = calloc(memb_size, 1);
-    for (uint8_t i = 0; i < memb_size; ++i)
-        *(p + i) = *(code + i);
+        if (!_decode_context_symbols(r + k, dst + k * segment + i, count - i,
+                model, previous + k))
+            return false;
+
+        if (r[k].overrun * 8 > r[k].count)
+            return false;
+    }
 
-    return p;
+    return true;
 }
 
 
-static void
-_append_prefix_code(uint8_t * c, uint8_t memb_size, uint8_t pos, bool bit) {
-    /* First of all bit at pos must be set to 0 to perform bitwise or
-     * correctly (probably, bitwise or is not the right choice).  */
-    if (bit)
-        c[pos / 8] |= (1 << (7 - pos % 8));
+static struct huffman_table *
+_train_table(uint64_t * counts, uint32_t id, uint8_t max_code_length) {
+    /* Byte values absent from samples still get codes, the longest ones.  */
+    for (uint16_t j = 0; j < 256; ++j)
+        ++counts[j];
 
-    /* If bit at pos is 1 but must be set to zero, bitwise or
-     * can not be used.  */
-    else if (c[pos / 8] & (1 << (7 - pos % 8)))
-        c[pos / 8] ^= (1 << (7 - pos % 8));
+    struct huffman_tree tree;
+    _build_huffman_tree(&tree, counts);
+    _limit_code_lengths(&tree, max_code_length);
 
-    /* Set separating 1. */
-    c[++pos / 8] |= (1 << (7 - pos % 8));
+    uint8_t lengths[256];
+    _get_code_lengths(&tree, lengths);
+
+    return _create_table(id, lengths);
 }
 
 
-static uint8_t
-_get_prefix_code_length(uint8_t * c, uint8_t memb_size) {
-    for (uint8_t i = memb_size - 1; i >= 0; --i) {
-        if (c[i] == 0)
-            continue;
+static struct huffman_table *
+_create_table(uint32_t id, uint8_t const * lengths) {
+    for (uint16_t j = 0; j < 256; ++j)
+        if (lengths[j] == 0)
+            return NULL;
+
+    struct huffman_table * table = malloc(sizeof(struct huffman_table));
+    if (table == NULL)
+        return NULL;
 
-        for (uint8_t j = 0; j < 8; ++j) /* Could change j < 8 to j < 7, because there is at leaste one 1 bit.  */
-            if (c[i] & (1 << j))    /* (1 << j) in O(n2) - need separate variable?  */
-                return i * 8 + (7 - j);
+    table->id = id;
+    memcpy(table->lengths, lengths, 256);
+
+    if (!_build_decode_table(lengths, &table->decode_table)) {
+        free(table);
+        return NULL;
     }
+
+    table->max_length = table->decode_table.max_length;
+    _build_encode_table(lengths, table->encode_table);
+
+    return table;
 }
 
 
-static char *
-_cast_prefix_code_to_cstring(uint8_t * prefix_code, uint8_t memb_size) {
-    uint8_t length = _get_prefix_code_length(prefix_code, memb_size);
-    char * char_code = calloc(length + 1, sizeof(char));
-    
-    /* There is such a string, that its huffman tree height is 255.  */
-    for (uint16_t j = 0; j < length; ++j) {
-        uint8_t a = prefix_code[j / 8];
+static void
+_adaptive_build(struct huffman_adaptive * a, bool encoding, bool decoding) {
+    _build_huffman_tree(&a->tree, a->counts);
+    _limit_code_lengths(&a->tree, a->max_code_length);
+    a->max_length = _get_code_lengths(&a->tree, a->lengths);
 
-        if (a & (1 << (7 - j % 8)))
-            char_code[j] = '1';
-                
-        else
-            char_code[j] = '0';
+    if (encoding)
+        _build_encode_table(a->lengths, a->encode_table);
+
+    /* Lengths of a tree always form a prefix code.  */
+    if (decoding)
+        _build_decode_table(a->lengths, &a->decode_table);
+}
+
+
+static void
+_adaptive_update(struct huffman_adaptive * a, uint8_t const * src, size_t n,
+    bool decoding)
+{
+    /* Short pieces, e.g. lines of a live stream, are not worth tables of
+     * counts.  */
+    if (n < HUFFMAN_ADAPTIVE_MIN_TABLE_COUNT)
+        for (size_t i = 0; i < n; ++i)
+            ++a->counts[src[i]];
+
+    else {
+        uint64_t counts[256];
+        _count_frequencies(src, n, counts);
+
+        for (uint16_t j = 0; j < 256; ++j)
+            a->counts[j] += counts[j];
+    }
+
+    a->symbols  += n;
+    a->total    += n;
+    a->left     -= n;
+
+    if (a->left != 0)
+        return;
+
+    while (a->total > HUFFMAN_ADAPTIVE_MAX_TOTAL) {
+        a->total = 0;
+        for (uint16_t j = 0; j < 256; ++j) {
+            a->counts[j] = (a->counts[j] + 1) / 2;
+            a->total += a->counts[j];
         }
-        
-    char_code[length] = '\0';
+    }
 
-    return char_code;
+    _adaptive_build(a, !decoding, decoding);
+
+    if (a->period < a->interval)
+        a->period = 2 * a->period < a->interval ? 2 * a->period : a->interval;
+
+    a->left = a->period;
 }
 
 
-static struct huffman_tree *
-_restore_huffman_tree(uint8_t * codes) {
-    uint8_t     counter     = codes[0];
-    uint8_t     memb_size   = codes[1];
-    uint16_t    period      = memb_size + 1;
+static bool
+_can_repeat(uint64_t const * counts, uint8_t const * lengths, size_t n) {
+    uint16_t symbols = 0, last = 0;
+    double entropy = 0;
 
-    struct _huffman_tree_node * root = \
-        _create_huffman_tree_node('\0', 0, false);
-    struct _huffman_tree_node * node;
+    for (uint16_t j = 0; j < 256; ++j) {
+        if (counts[j] == 0)
+            continue;
 
-    char        character;
-    uint32_t    code_index;
+        if (lengths[j] == 0)
+            return false;
 
-    for (uint8_t i = 0; i < counter; ++i) {
-        node        = root;
-        character   = codes[2 + period * i];
-        code_index  = 3 + i * period;
+        ++symbols;
+        last = j;
+        entropy += counts[j] * log2((double)n / counts[j]);
+    }
 
-        uint8_t length = \
-            _get_prefix_code_length(codes + code_index, memb_size);
+    /* Fresh codes are not shorter than entropy, their header is the
+     * smaller of two layouts written by _write_code_lengths.  */
+    uint16_t header_size = 2 + (last + 2) / 2;
+    if (header_size > 1 + 32 + symbols)
+        header_size = 1 + 32 + symbols;
 
-        uint8_t mask, byte;
+    double fresh_size = entropy / 8 + header_size;
+    uint64_t size = _coded_size(counts, lengths);
 
-        for (uint16_t bit = 0; bit < length - 1; ++bit) {
-            byte    = bit / 8;
-            mask    = bit % 8;
+    return size <= fresh_size + fresh_size / HUFFMAN_REPEAT_TOLERANCE;
+}
 
-            if (codes[code_index + byte] & (1 << (7 - mask))) {
-                if (node->right == NULL)
-                    node->right = _create_huffman_tree_node('\0', 0, false);
 
-                node = node->right;
-            }
+static uint64_t
+_coded_size(uint64_t const * counts, uint8_t const * lengths) {
+    uint64_t bits = 0;
+    for (uint16_t j = 0; j < 256; ++j)
+        bits += counts[j] * lengths[j];
 
-            else {
-                if (node->left == NULL)
-                    node->left = _create_huffman_tree_node('\0', 0, false);
+    return (bits + 7) / 8;
+}
 
-                node = node->left;
-            }
-        }
 
-        if (codes[code_index + (length - 1) / 8]
-                & (1 << (7 - (length - 1) % 8)))
-            node->right = _create_huffman_tree_node(character, 0, true);
+static uint8_t
+_stream_size_width(size_t segment, uint8_t max_length) {
+    uint64_t max_size = segment / 8 * max_length + max_length;
+
+    uint8_t width = 1;
+    while (width < 8 && max_size >> (8 * width) != 0)
+        ++width;
 
-        else
-            node->left = _create_huffman_tree_node(character, 0, true);
+    return width;
+}
+
+
+static size_t
+_write_varint(uint8_t * out, uint64_t value) {
+    size_t size = 0;
+
+    while (value >= 128) {
+        out[size++] = (value & 127) | 128;
+        value >>= 7;
     }
 
-    return _create_huffman_tree(root);
+    out[size++] = value;
+
+    return size;
 }
 
 
-static char *
-_decompress_huffman_using_tree(uint8_t const * compressed_string,
-    uint64_t size, struct huffman_tree * t)
-{
-    char * string = calloc(DEFAULT_STRING_SIZE, 1);
-    /* Using max function is needed to prevent the situation when
-     * DEFAULT_STRING_SIZE equals to 0 by some reason.  */
-    uint64_t max_string_size    = DEFAULT_STRING_SIZE;
-    uint64_t string_index       = 0;
-
-    uint8_t mask = 128;  /* 0b10000000.  */
-    uint64_t byte_index = 0;
-    struct _huffman_tree_node * node = t->root;
-
-    while (string_index < size) {
-        if (mask == 0) {
-            mask = 128;
-            ++byte_index;
-        }
+static size_t
+_read_varint(uint8_t const * in, size_t n, uint64_t * value) {
+    *value = 0;
 
-        if (compressed_string[byte_index] & mask)
-            node = node->right;
+    for (size_t i = 0; i < n && i < HUFFMAN_MAX_VARINT_SIZE; ++i) {
+        *value |= (uint64_t)(in[i] & 127) << (7 * i);
+        if (!(in[i] & 128))
+            return i + 1;
+    }
 
-        else
-            node = node->left;
-
-        if (node->is_leaf) {
-            string[string_index++] = node->key;
-            node = t->root;
-
-            if (string_index == max_string_size) {
-                max_string_size = string_index * 2;
-                char * new_string = calloc(max_string_size, 1);
-                for (uint64_t i = 0; i < string_index; ++i)
-                    new_string[i] = string[i];
-                
-                free(string);
-                string = new_string;
-            }
-        }
+    return 0;
+}
+
+
+static bool
+_kernel_supported(enum huffman_kernel kernel) {
+    switch (kernel) {
+        case HUFFMAN_KERNEL_GENERIC:
+            return true;
 
-        mask >>= 1;
+#ifdef HUFFMAN_X86_KERNELS
+        case HUFFMAN_KERNEL_BMI2:
+            return __builtin_cpu_supports("bmi2")
+                && __builtin_cpu_supports("avx2");
+#endif
+
+        default:
+            return false;
     }
+}
 
-    string[string_index++] = '\0';
 
-    char * decompressed_string = calloc(string_index, 1);
-    for (uint64_t i = 0; i < string_index; ++i)
-        decompressed_string[i] = string[i];
-                
-    free(string);
+#ifdef HUFFMAN_X86_KERNELS
+
+__attribute__((constructor))
+static void
+_select_kernel(void) {
+    __builtin_cpu_init();
 
-    return decompressed_string;
+    if (_kernel_supported(HUFFMAN_KERNEL_BMI2))
+        _kernel = HUFFMAN_KERNEL_BMI2;
 }
 
 
+__attribute__((target("bmi2,avx2")))
 static void
-_swap(struct _huffman_tree_node * p, struct _huffman_tree_node * q) {
-    if (p == q)
-        return;
+_encode_bmi2(uint8_t const * src, size_t n,
+    struct _encode_entry const * table, uint8_t max_length,
+    struct _bit_writer * w)
+{
+    _encode_using_table(src, n, table, max_length, w);
+}
+
 
-    struct _huffman_tree_node t;
-    t.key = p->key; t.value = p->value;
-    t.left = p->left; t.right = p->right;
-    t.is_leaf = p->is_leaf;
+__attribute__((target("bmi2,avx2")))
+static bool
+_decode_bmi2(uint8_t const * src, size_t n, uint8_t * dst,
+    size_t size, struct _decode_table const * table)
+{
+    return _decode_using_table(src, n, dst, size, table);
+}
 
-    p->key = q->key; p->value = q->value;
-    p->left = q->left; p->right = q->right;
-    p->is_leaf = q->is_leaf;
 
-    q->key = t.key; q->value = t.value;
-    q->left = t.left; q->right = t.right;
-    q->is_leaf = t.is_leaf;
+__attribute__((target("bmi2,avx2")))
+static bool
+_decode_interleaved_bmi2(uint8_t const * const * src, size_t const * n,
+    uint8_t * dst, size_t size, struct _decode_table const * table)
+{
+    return _decode_interleaved(src, n, dst, size, table);
 }
+
+#endif
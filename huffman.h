@@ -8,30 +8,479 @@
 #include <stdbool.h>
 #include <math.h>
 
+/* Kernels for x86 processors are compiled in with GCC and Clang and chosen
+ * at run time by features of the processor.  */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HUFFMAN_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/* Hot helpers are forced inline, so that every kernel gets its own copy of
+ * them compiled for its instruction set.  */
+#ifdef __GNUC__
+#define HUFFMAN_INLINE  inline __attribute__((always_inline))
+#else
+#define HUFFMAN_INLINE  inline
+#endif
 
-#define DEFAULT_HEAP_SIZE   256 /* Must belong to (0, UINT64_MAX).  */
-#define DEFAULT_STRING_SIZE 128 /* Must belong to (0, UINT64_MAX).  */
+
+#define DEFAULT_HEAP_SIZE   256 /* Number of distinct characters.  */
+
+#define HUFFMAN_TABLE_BITS          11  /* Bits resolved by one table probe.  */
+#define HUFFMAN_MAX_TABLE_BITS      15  /* Widest table for single probe.  */
+#define HUFFMAN_MAX_DECODE_LENGTH   56  /* Bits guaranteed after refill.  */
+
+/* Limits of code length. Codes of 256 characters need at least 8 bits.  */
+#define HUFFMAN_MIN_CODE_LENGTH_LIMIT   8
+#define HUFFMAN_DEFAULT_MAX_CODE_LENGTH HUFFMAN_TABLE_BITS
+
+/* Layouts of serialized code lengths.  */
+#define HUFFMAN_LENGTHS_NIBBLES     0   /* Last character, 4 bits per length.  */
+#define HUFFMAN_LENGTHS_BITMAP      1   /* 256-bit bitmap, byte per length.  */
+#define HUFFMAN_MAX_ALPHABET_SIZE   (1 + 32 + 256)
+#define HUFFMAN_MAX_VARINT_SIZE     10
+
+/* Block type byte follows original size of non-empty input. Its low bits
+ * tell how block is coded, flags are or-ed to them.  */
+#define HUFFMAN_BLOCK_CODED         0   /* Code lengths and codes.  */
+#define HUFFMAN_BLOCK_RAW           1   /* Input as is.  */
+#define HUFFMAN_BLOCK_RLE           2   /* The only byte value of input.  */
+#define HUFFMAN_BLOCK_REPEAT        3   /* Codes of the previous table.  */
+#define HUFFMAN_BLOCK_STATIC        4   /* Table id and its codes.  */
+#define HUFFMAN_BLOCK_CONTEXT       5   /* Clusters of contexts and codes.  */
+#define HUFFMAN_BLOCK_TYPES         6
+#define HUFFMAN_BLOCK_TYPE_MASK     0x0F
+#define HUFFMAN_BLOCK_INTERLEAVED   0x10    /* Codes in HUFFMAN_STREAMS streams.  */
+#define HUFFMAN_BLOCK_SYNC          0x20    /* Codes in streams of sync interval.  */
+
+/* Interleaved block splits input into HUFFMAN_STREAMS segments of equal
+ * size, the last one takes the remainder. Each segment is coded into its
+ * own bitstream, sizes of all streams but the last are stored before them,
+ * so that the decoder can run through all streams at once. Inputs shorter
+ * than HUFFMAN_MIN_INTERLEAVED_SIZE are always coded into one stream.  */
+#define HUFFMAN_STREAMS                 4
+#define HUFFMAN_MIN_INTERLEAVED_SIZE    1024
+#define HUFFMAN_MAX_HEADER_SIZE     (HUFFMAN_MAX_VARINT_SIZE + 1 \
+    + HUFFMAN_MAX_ALPHABET_SIZE + 8 * (HUFFMAN_STREAMS - 1))
+
+/* Block with sync points splits input into segments of sync interval
+ * symbols instead, the last one takes the remainder. Interval is stored
+ * before sizes of streams. A slice of such block is decoded from streams
+ * covering it only, so that it costs at most one interval more than the
+ * slice itself. Streams are still decoded HUFFMAN_STREAMS at once.  */
+#define HUFFMAN_MIN_SYNC_INTERVAL   1024
+
+/* Context block codes each byte with the table of its context, i.e. of the
+ * previous byte, which is 0 at the beginning of each stream. Contexts are
+ * grouped into up to HUFFMAN_MAX_CLUSTERS clusters sharing a table. Header
+ * holds number of clusters, cluster of each context (4 bits each) and code
+ * lengths of each cluster. Codes are at most HUFFMAN_TABLE_BITS long, so
+ * that each byte is still decoded with a single table probe. Inputs shorter
+ * than HUFFMAN_MIN_CONTEXT_SIZE are not worth such header.  */
+#define HUFFMAN_MAX_CLUSTERS        16
+#define HUFFMAN_CLUSTER_MAP_SIZE    128
+#define HUFFMAN_MIN_CONTEXT_SIZE    16384
+#define HUFFMAN_MAX_CONTEXT_HEADER_SIZE (HUFFMAN_MAX_VARINT_SIZE + 2 \
+    + HUFFMAN_CLUSTER_MAP_SIZE + HUFFMAN_MAX_CLUSTERS \
+    * HUFFMAN_MAX_ALPHABET_SIZE)
+
+/* Contexts are clustered by a few rounds of moving each one to the cluster
+ * whose codes suit it best.  */
+#define HUFFMAN_CLUSTER_ROUNDS      2
+
+/* Max size of serialized static table: its id and code lengths.  */
+#define HUFFMAN_MAX_TABLE_SIZE      (HUFFMAN_MAX_VARINT_SIZE \
+    + HUFFMAN_MAX_ALPHABET_SIZE)
+
+/* Previous code table is repeated if its codes are at most 1/32 longer than
+ * estimated size of fresh codes with their header.  */
+#define HUFFMAN_REPEAT_TOLERANCE    32
+
+/* Histogram is counted into several tables of 32-bit counts, which are
+ * added up after each chunk of input.  */
+#define HUFFMAN_HISTOGRAM_TABLES        4
+#define HUFFMAN_HISTOGRAM_CHUNK_SIZE    ((size_t)1 << 30)
+
+/* Adaptive coding builds codes from counts of the symbols coded so far,
+ * first after HUFFMAN_ADAPTIVE_MIN_INTERVAL symbols, then after twice as
+ * many and so on up to interval symbols. Counts are halved once they add up
+ * to more than HUFFMAN_ADAPTIVE_MAX_TOTAL, so that codes follow recent
+ * data. Every byte value keeps a count of at least one, so it has a code.  */
+#define HUFFMAN_ADAPTIVE_MIN_INTERVAL       256
+#define HUFFMAN_ADAPTIVE_MAX_INTERVAL       ((size_t)1 << 20)
+#define HUFFMAN_ADAPTIVE_DEFAULT_INTERVAL   ((size_t)1 << 14)
+#define HUFFMAN_ADAPTIVE_MAX_TOTAL          ((uint64_t)1 << 22)
+
+/* Pieces shorter than this are counted byte by byte rather than with
+ * tables of counts, which do not pay off for them.  */
+#define HUFFMAN_ADAPTIVE_MIN_TABLE_COUNT    1024
+
+/* Returned by compression functions instead of size on failure.  */
+#define HUFFMAN_ERROR               ((size_t)-1)
+
+/* Statistics (see huffman_stats) are collected only when HUFFMAN_STATS is
+ * defined, otherwise the macros collecting them expand to nothing. Timer is
+ * read only if there is somewhere to add time to.  */
+#ifdef HUFFMAN_STATS
+#include <time.h>
+
+#define HUFFMAN_STATS_ADD(stats, field, value) \
+    do { if ((stats) != NULL) (stats)->field += (value); } while (0)
+
+#define HUFFMAN_STATS_MAX(stats, field, value) \
+    do { \
+        if ((stats) != NULL && (stats)->field < (value)) \
+            (stats)->field = (value); \
+    } while (0)
+
+#define HUFFMAN_STATS_START(stats, start) \
+    uint64_t start = (stats) != NULL ? _huffman_now_ns() : 0
+
+#define HUFFMAN_STATS_TIME(stats, field, start) \
+    HUFFMAN_STATS_ADD(stats, field, _huffman_now_ns() - (start))
+
+static inline uint64_t
+_huffman_now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+#define HUFFMAN_STATS_BLOCK(stats, type, n, size, header_size) \
+    do { \
+        HUFFMAN_STATS_ADD(stats, blocks[type], 1); \
+        HUFFMAN_STATS_ADD(stats, bytes_in, n); \
+        HUFFMAN_STATS_ADD(stats, bytes_out, size); \
+        HUFFMAN_STATS_ADD(stats, header_bytes, header_size); \
+    } while (0)
+
+#else
+#define HUFFMAN_STATS_BLOCK(stats, type, n, size, header_size)
+#define HUFFMAN_STATS_ADD(stats, field, value)
+#define HUFFMAN_STATS_MAX(stats, field, value)
+#define HUFFMAN_STATS_START(stats, start)
+#define HUFFMAN_STATS_TIME(stats, field, start)
+#endif
 
 
 /* ________ "Public" functions and structures. ________ */
 
 struct huffman_tree;
 
-/* Build huffman tree for given c-string.  */
+/* Reusable state of compression and decompression. Context owns memory for
+ * tree nodes, tables and scratch space, so calls using it do not allocate,
+ * except once for context codes (see huffman_ctx_set_clusters).
+ * Context must not be shared between threads, use one per thread.  */
+struct huffman_ctx;
+
+/* Static code table for many small similar inputs, e.g. messages of one
+ * protocol. Table is trained on samples of such inputs ahead of time and
+ * known to both sides, so neither a histogram nor code lengths are needed
+ * per input. Table is read only once created and can be shared between
+ * threads.  */
+struct huffman_table;
+
+/* Where time goes and what data was like, summed over calls with contexts
+ * using it. Header is original size, block type and code lengths or table
+ * id of each block.  */
+struct huffman_stats {
+    uint64_t    histogram_ns;
+    uint64_t    build_ns;       /* Code lengths and tables.  */
+    uint64_t    encode_ns;
+    uint64_t    decode_ns;
+    uint64_t    io_ns;          /* Reading and writing files.  */
+
+    uint64_t    bytes_in;
+    uint64_t    bytes_out;
+    uint64_t    header_bytes;
+    uint64_t    blocks[HUFFMAN_BLOCK_TYPES];    /* By type.  */
+    uint64_t    allocations;
+
+    uint16_t    max_symbols;    /* Most distinct byte values in a block.  */
+    uint8_t     max_code_length;
+};
+
+/* State of adaptive coding of one stream, either compressed or
+ * decompressed, see huffman_adaptive_encode.  */
+struct huffman_adaptive;
+
+/* One of many inputs of a batch.  */
+struct huffman_record {
+    void const *    data;
+    size_t          size;
+};
+
+/* Implementations of histogram, encoding and decoding loops. All of them
+ * produce the same output. The fastest one the processor supports is
+ * chosen at startup.  */
+enum huffman_kernel {
+    HUFFMAN_KERNEL_GENERIC = 0,     /* Portable 64-bit code.  */
+    HUFFMAN_KERNEL_BMI2,            /* x86-64 with BMI2 and AVX2.  */
+    HUFFMAN_KERNELS
+};
+
+/* Build huffman tree for n bytes of src. Tree is a single block of memory,
+ * which is to be released by free. Tree of empty input has no nodes and no
+ * codes. Returns NULL if there is not enough memory.  */
 struct huffman_tree * 
-huffman(char const *);
-
-/* Compress given cstring using huffman. Returns compressed string which size
- * is returned by pointer size. Alphabet of characters with corresponding
- * huffman codes is return by pointer a.  */
-uint8_t const *
-compress_huffman(char const * str, uint64_t * size, uint8_t ** a);
-
-/* Decompress cstring, that was previously compressed using huffman codes
- * algorithm implemented in function compress_huffman. Returns cstring. */
-char *
-decompress_huffman(uint8_t const * compressed_string,
-    uint64_t size, uint8_t * alphabet);
+huffman(void const * src, size_t n);
+
+/* Kernel in use.  */
+enum huffman_kernel
+huffman_get_kernel(void);
+
+/* Use given kernel from now on, e.g. to compare kernels. Must not be called
+ * while other threads compress or decompress. Returns false if kernel is
+ * not supported by the processor or not compiled in.  */
+bool
+huffman_set_kernel(enum huffman_kernel);
+
+char const *
+huffman_kernel_name(enum huffman_kernel);
+
+/* Allocate context. Returns NULL if there is not enough memory.  */
+struct huffman_ctx *
+huffman_ctx_create(void);
+
+/* Forget everything context has kept from previous calls and restore
+ * default settings.  */
+void
+huffman_ctx_reset(struct huffman_ctx *);
+
+/* Set number of streams for compression, 1 or HUFFMAN_STREAMS (default).
+ * Several streams are decoded faster, as the decoder works on all of them
+ * at once. Returns false for other values.  */
+bool
+huffman_ctx_set_streams(struct huffman_ctx *, uint8_t streams);
+
+/* Let compression repeat code table of the previous call with the same
+ * context when it fits the input well enough, which saves building a new
+ * table and storing it. Compressed data then depends on the previous one
+ * and can only be decompressed by a context that has decompressed all data
+ * of this context in the same order. Off by default.  */
+void
+huffman_ctx_set_repeat(struct huffman_ctx *, bool repeat);
+
+/* Set limit of code length for compression, HUFFMAN_DEFAULT_MAX_CODE_LENGTH
+ * by default. Codes of up to HUFFMAN_MAX_TABLE_BITS bits are decoded with a
+ * single table probe. Returns false if length is not within
+ * [HUFFMAN_MIN_CODE_LENGTH_LIMIT, HUFFMAN_MAX_DECODE_LENGTH].  */
+bool
+huffman_ctx_set_max_code_length(struct huffman_ctx *, uint8_t length);
+
+/* Let compression code each byte with codes depending on the previous one,
+ * with up to clusters tables (see HUFFMAN_BLOCK_CONTEXT), or stop with 0 or
+ * 1 (default). Context codes are used only where they come out shorter
+ * than a single table, which takes more time to find out. Memory for them
+ * is allocated at first use by compression or decompression, which fall
+ * back to a single table or fail if there is not enough of it. Returns
+ * false if clusters is greater than HUFFMAN_MAX_CLUSTERS.  */
+bool
+huffman_ctx_set_clusters(struct huffman_ctx *, uint8_t clusters);
+
+/* Place sync points every interval bytes of compressed blocks, see
+ * HUFFMAN_BLOCK_SYNC, or stop with interval 0 (default). Inputs up to
+ * interval bytes are compressed as usual. Returns false if interval is
+ * less than HUFFMAN_MIN_SYNC_INTERVAL.  */
+bool
+huffman_ctx_set_sync_interval(struct huffman_ctx *, size_t interval);
+
+/* Add statistics of calls with ctx to stats, or stop if it is NULL.
+ * Returns false if statistics are not compiled in.  */
+bool
+huffman_ctx_set_stats(struct huffman_ctx *, struct huffman_stats * stats);
+
+/* Add statistics from to statistics to, e.g. of several threads.  */
+void
+huffman_stats_add(struct huffman_stats * to, struct huffman_stats const * from);
+
+void
+huffman_ctx_free(struct huffman_ctx *);
+
+/* Max size of compressed data for n bytes of input. Input that would not
+ * become smaller is stored as is, so it is just a bit larger than n.  */
+size_t
+huffman_compress_bound(size_t n);
+
+/* Compress n bytes of src using canonical huffman codes into dst of cap
+ * bytes. Compressed data holds original size, block type, code lengths and
+ * codes. Context of the call is allocated and freed by it.
+ * Returns compressed size or HUFFMAN_ERROR if it does not fit into dst or
+ * there is not enough memory for the context. Output always fits if cap is
+ * huffman_compress_bound(n).  */
+size_t
+huffman_compress(void const * src, size_t n, void * dst, size_t cap);
+
+/* Decompress n bytes of src, previously compressed by huffman_compress,
+ * into dst of cap bytes, with a context allocated for the call. Returns
+ * decompressed size or HUFFMAN_ERROR if src is malformed, decompressed data
+ * does not fit into dst or there is not enough memory.  */
+size_t
+huffman_decompress(void const * src, size_t n, void * dst, size_t cap);
+
+/* Original size of data compressed into n bytes of src, which is stored at
+ * its beginning, so that output can be allocated with exact size before
+ * decompression. Returns HUFFMAN_ERROR if src is too short to tell.  */
+size_t
+huffman_decompressed_size(void const * src, size_t n);
+
+/* Type of block (HUFFMAN_BLOCK_* without flags) of data compressed into n
+ * bytes of src, e.g. to find the block a repeated code table comes from.
+ * Returns -1 if src is malformed or holds empty input.  */
+int
+huffman_block_type(void const * src, size_t n);
+
+/* Decompress length bytes from offset of original data out of n bytes of
+ * src, previously compressed by huffman_compress, into dst. Only streams
+ * covering the slice are decoded, see HUFFMAN_BLOCK_SYNC. Returns number of
+ * bytes stored, which is less than length if the slice runs past the end of
+ * data, or HUFFMAN_ERROR if src is malformed or there is not enough memory
+ * for the context of the call.  */
+size_t
+huffman_decompress_range(void const * src, size_t n, size_t offset,
+    size_t length, void * dst);
+
+/* Same as huffman_compress and huffman_decompress, but use memory of ctx
+ * instead of allocating a context per call.  */
+
+size_t
+huffman_compress_ctx(struct huffman_ctx * ctx, void const * src, size_t n,
+    void * dst, size_t cap);
+
+size_t
+huffman_decompress_ctx(struct huffman_ctx * ctx, void const * src, size_t n,
+    void * dst, size_t cap);
+
+/* Same as huffman_decompress_range with context, which may hold code table
+ * repeated by src. Code table of src is kept, even if length is 0, so that
+ * following data can repeat it.  */
+size_t
+huffman_decompress_range_ctx(struct huffman_ctx * ctx, void const * src,
+    size_t n, size_t offset, size_t length, void * dst);
+
+/* Build table identified by id with codes of up to max_code_length bits
+ * for n bytes of samples, which are inputs to come concatenated. Byte
+ * values absent from samples get the longest codes. Returns NULL if length
+ * is out of range (see huffman_ctx_set_max_code_length) or there is not
+ * enough memory.  */
+struct huffman_table *
+huffman_table_train(void const * samples, size_t n, uint32_t id,
+    uint8_t max_code_length);
+
+/* Serialize table into dst of cap bytes: its id and code lengths, at most
+ * HUFFMAN_MAX_TABLE_SIZE bytes. Returns size written or HUFFMAN_ERROR if it
+ * does not fit.  */
+size_t
+huffman_table_save(struct huffman_table const *, void * dst, size_t cap);
+
+/* Restore table from exactly n bytes of src written by huffman_table_save.
+ * Returns NULL if src is malformed or there is not enough memory.  */
+struct huffman_table *
+huffman_table_load(void const * src, size_t n);
+
+uint32_t
+huffman_table_id(struct huffman_table const *);
+
+void
+huffman_table_free(struct huffman_table *);
+
+/* Compress n bytes of src with codes of table into dst of cap bytes.
+ * Compressed data holds original size, block type, table id and codes.
+ * Input that would not become smaller is stored as is, so output always
+ * fits if cap is huffman_compress_bound(n). Returns compressed size or
+ * HUFFMAN_ERROR if it does not fit into dst.  */
+size_t
+huffman_compress_table(struct huffman_table const *, void const * src,
+    size_t n, void * dst, size_t cap);
+
+/* Decompress n bytes of src, previously compressed by
+ * huffman_compress_table with table of the same id, into dst of cap bytes.
+ * Returns decompressed size or HUFFMAN_ERROR if src is malformed, belongs to
+ * another table or does not fit into dst.  */
+size_t
+huffman_decompress_table(struct huffman_table const *, void const * src,
+    size_t n, void * dst, size_t cap);
+
+/* Max size of compressed data of batch of count inputs.  */
+size_t
+huffman_compress_batch_bound(struct huffman_record const * inputs,
+    size_t count);
+
+/* Compress count inputs one after another into dst of cap bytes, each one
+ * as by huffman_compress_table with the same table. Without table (NULL)
+ * one is trained on all inputs with id 0 and saved at the beginning of dst
+ * as by huffman_table_save. Offset of each compressed record in dst is
+ * stored into offsets, which has room for count + 1 of them, the last one
+ * is the total size. Returns total size or HUFFMAN_ERROR if it does not fit
+ * into dst or there is not enough memory for table. Output always fits if
+ * cap is huffman_compress_batch_bound.  */
+size_t
+huffman_compress_batch(struct huffman_table const *,
+    struct huffman_record const * inputs, size_t count, void * dst,
+    size_t cap, size_t * offsets);
+
+/* Decompress count records of src at given offsets, as stored by
+ * huffman_compress_batch, one after another into dst of cap bytes. Without
+ * table (NULL) it is loaded from the beginning of src up to the first
+ * record. Offsets of decompressed records in dst are stored into
+ * dst_offsets like by huffman_compress_batch. Returns total decompressed
+ * size or HUFFMAN_ERROR if some record is malformed, does not fit into dst
+ * or there is not enough memory for table.  */
+size_t
+huffman_decompress_batch(struct huffman_table const *, void const * src,
+    size_t const * offsets, size_t count, void * dst, size_t cap,
+    size_t * dst_offsets);
+
+/* Allocate state of adaptive coding with default settings. Returns NULL if
+ * there is not enough memory.  */
+struct huffman_adaptive *
+huffman_adaptive_create(void);
+
+/* Start a new stream with default settings.  */
+void
+huffman_adaptive_reset(struct huffman_adaptive *);
+
+/* Set the longest interval between rebuilds of codes,
+ * HUFFMAN_ADAPTIVE_DEFAULT_INTERVAL by default. Shorter intervals follow
+ * changes of data sooner at the cost of more rebuilds. Returns false if
+ * interval is not within [HUFFMAN_ADAPTIVE_MIN_INTERVAL,
+ * HUFFMAN_ADAPTIVE_MAX_INTERVAL] or the stream has begun.  */
+bool
+huffman_adaptive_set_interval(struct huffman_adaptive *, size_t interval);
+
+/* Set limit of code length, see huffman_ctx_set_max_code_length. Returns
+ * false if length is out of range or the stream has begun.  */
+bool
+huffman_adaptive_set_max_code_length(struct huffman_adaptive *,
+    uint8_t length);
+
+void
+huffman_adaptive_free(struct huffman_adaptive *);
+
+/* Max size of compressed chunk of n bytes.  */
+size_t
+huffman_adaptive_bound(struct huffman_adaptive const *, size_t n);
+
+/* Compress n bytes of src, the next chunk of a stream, into dst of cap
+ * bytes as soon as they are there. Chunk holds its size and codes only:
+ * both sides count symbols and rebuild codes the same way, so no table is
+ * stored and nothing waits for a whole block. Chunks are decompressed by
+ * huffman_adaptive_decode with the same settings in the same order.
+ * Returns compressed size or HUFFMAN_ERROR if it does not fit into dst,
+ * after which the stream is to be reset. Output always fits if cap is
+ * huffman_adaptive_bound(n).  */
+size_t
+huffman_adaptive_encode(struct huffman_adaptive *, void const * src,
+    size_t n, void * dst, size_t cap);
+
+/* Decompress exactly n bytes of src, the next chunk of a stream compressed
+ * by huffman_adaptive_encode, into dst of cap bytes. Returns decompressed
+ * size or HUFFMAN_ERROR if src is malformed or does not fit into dst, after
+ * which the stream is to be reset.  */
+size_t
+huffman_adaptive_decode(struct huffman_adaptive *, void const * src,
+    size_t n, void * dst, size_t cap);
 
 uint64_t *
 get_char_frequencies(struct huffman_tree *);
@@ -52,79 +501,361 @@ height(struct huffman_tree *);
 
 struct _huffman_tree_node;
 
-struct _heap;
+struct _encode_entry;
 
-/* Heap operations.  */
+struct _decode_table;
 
-static void
-_heapify_nondesc(struct _heap *, uint64_t);
+struct _bit_writer;
+
+struct _bit_reader;
+
+struct _huffman_kernel;
+
+struct _stream_layout;
+
+struct _context_model;
 
-/* Priority queue operations.  */
+static bool
+_kernel_supported(enum huffman_kernel);
 
-static struct _huffman_tree_node *
-_minimum(struct _heap *);
+#ifdef HUFFMAN_X86_KERNELS
 
-static struct _huffman_tree_node *
-_extract_minimum(struct _heap *);
+/* Choose the fastest supported kernel before main.  */
+static void
+_select_kernel(void);
+
+/* Entry points of BMI2 kernel: generic loops compiled with BMI2, so that
+ * variable shifts of bit buffers are shlx and shrx, which do not depend on
+ * flags.  */
 
 static void
-_insert(struct _heap *, struct _huffman_tree_node *);
+_encode_bmi2(uint8_t const * src, size_t n,
+    struct _encode_entry const * table, uint8_t max_length,
+    struct _bit_writer *);
+
+static bool
+_decode_bmi2(uint8_t const * src, size_t n, uint8_t * dst,
+    size_t size, struct _decode_table const *);
 
-/* Create empty heap of DEFAULT_HEAP_SIZE size.  */
-static struct _heap *
-_initialize_heap();
+static bool
+_decode_interleaved_bmi2(uint8_t const * const * src, size_t const * n,
+    uint8_t * dst, size_t size, struct _decode_table const *);
+
+#endif
 
 /* Huffman code functions.  */
 
-/* Create node with given parameters.  */
-static struct _huffman_tree_node *
-_create_huffman_tree_node(char, uint64_t, bool);
+/* Fill array of 256 counts of each byte value in n bytes of src.  */
+static void
+_count_frequencies(void const * src, size_t n, uint64_t * counts);
+
+/* Add counts of n bytes of src, n < 2^32, to tables. Consecutive bytes go
+ * to different tables, so that a run of the same byte does not wait for
+ * its own stores.  */
+static HUFFMAN_INLINE void
+_count_chunk(uint8_t const * src, size_t n,
+    uint32_t (* tables)[256]);
 
-static struct _heap *
-_count_char_frequencies(char const *);
+/* Count 8 bytes of word into tables, in turn.  */
+static HUFFMAN_INLINE void
+_count_word(uint32_t (* tables)[256], uint64_t word);
 
-static struct huffman_tree *
-_create_huffman_tree(struct _huffman_tree_node *);
+#ifdef HUFFMAN_X86_KERNELS
 
+/* Same as _count_chunk, but runs of 32 equal bytes are counted at once.  */
 static void
-_infix_traverse(struct _huffman_tree_node *, uint64_t *);
+_count_chunk_avx2(uint8_t const * src, size_t n,
+    uint32_t (* tables)[256]);
 
-static uint8_t
-_height(struct _huffman_tree_node *);
+#endif
 
-/* Recursively fill array of huffman codes "codes". depth stands for n'th 
- * node height (counting from top). path stores bits representing path to
- * node n in huffman tree. memb_size represents number of bytes, needed to 
- * store longest huffman code for given huffman tree.  */
+/* Sort leaves of tree t by value.  */
 static void
-_get_huffman_codes(struct _huffman_tree_node * n, uint8_t *** codes,
-    uint8_t * path, uint8_t depth, uint8_t memb_size);
+_sort_leaves(struct huffman_tree * t);
 
-static uint8_t *
-_copy_prefix_code(uint8_t *, uint8_t);
+/* Build tree t for given counts of characters. Without any character of
+ * non-zero count the tree is left empty.  */
+static void
+_build_huffman_tree(struct huffman_tree * t, uint64_t const * counts);
 
-/* Set bit at position pos of prefix code c to 1 if bit is true or to
- * 0 in other case.  */
+/* Make leaves of tree t not deeper than limit keeping Kraft inequality.
+ * Afterwards depths are code lengths, but not the shape of the tree.  */
 static void
-_append_prefix_code(uint8_t * c, uint8_t memb_size, uint8_t pos, bool bit);
+_limit_code_lengths(struct huffman_tree * t, uint8_t limit);
 
+/* Fill array of 256 code lengths (0 for absent characters). Returns
+ * length of the longest code.  */
 static uint8_t
-_get_prefix_code_length(uint8_t *, uint8_t memb_size);
+_get_code_lengths(struct huffman_tree *, uint8_t * lengths);
 
-static char *
-_cast_prefix_code_to_cstring(uint8_t *, uint8_t);
+/* Assign canonical huffman codes for given code lengths, codes of absent
+ * characters are left untouched.  */
+static void
+_assign_canonical_codes(uint8_t const * lengths, uint64_t * codes);
 
-/* The restored tree has the valid order of nodes, but has no info
- * about character frequencies. This tree can be used for decompressing
- * only.  */
-static struct huffman_tree *
-_restore_huffman_tree(uint8_t * codes);
+/* Fill table of 256 (code, length) pairs used by the encoder.  */
+static void
+_build_encode_table(uint8_t const * lengths, struct _encode_entry * table);
+
+/* Serialize code lengths into out, which must have at least
+ * HUFFMAN_MAX_ALPHABET_SIZE bytes. Returns number of bytes written.  */
+static uint64_t
+_write_code_lengths(uint8_t const * lengths, uint8_t * out);
+
+/* Restore code lengths written by _write_code_lengths. Returns number of
+ * bytes read or 0 if input is malformed.  */
+static uint64_t
+_read_code_lengths(uint8_t const * in, uint64_t size, uint8_t * lengths);
 
 static char *
-_decompress_huffman_using_tree(uint8_t const *, 
-    uint64_t, struct huffman_tree *);
+_cast_prefix_code_to_cstring(uint64_t code, uint8_t length);
+
+/* Decoding table operations.  */
+
+/* Build decoding table for canonical codes of given lengths. Returns false
+ * if lengths do not form a prefix code or some code is longer than
+ * HUFFMAN_MAX_DECODE_LENGTH.  */
+static bool
+_build_decode_table(uint8_t const * lengths, struct _decode_table *);
+
+/* Find code matching the beginning of window, used for codes longer than
+ * table bits. Returns NULL if there is no such code.  */
+static struct _long_code const *
+_find_long_code(struct _decode_table const *, uint64_t window);
+
+/* Bit input and output operations.  */
+
+static HUFFMAN_INLINE uint64_t
+_load_be64(uint8_t const *);
+
+static HUFFMAN_INLINE void
+_store_be64(uint8_t *, uint64_t);
+
+/* Append code of given length to the accumulator. There must be room for
+ * it, i.e. count + length <= 64.  */
+static HUFFMAN_INLINE void
+_put_bits(struct _bit_writer *, uint64_t code, uint8_t length);
+
+/* Store completed bytes of the accumulator, leaving at most 7 bits.  */
+static HUFFMAN_INLINE void
+_flush_bits(struct _bit_writer *);
+
+/* Store the remaining bits padded with zeros. Returns number of bytes
+ * written since the beginning of output, which is past its end if output
+ * has overflown.  */
+static uint64_t
+_finish_bits(struct _bit_writer *);
 
+/* Make the bit reader hold at least 56 bits.  */
+static HUFFMAN_INLINE void
+_refill(struct _bit_reader *);
+
+/* Same as _refill near the end of input, kept apart so that _refill is
+ * small enough to be inlined into decoding loops.  */
+static void
+_refill_tail(struct _bit_reader *);
+
+/* Huffman payload operations.  */
+
+static HUFFMAN_INLINE void
+_encode_using_table(uint8_t const * src, size_t n,
+    struct _encode_entry const * table, uint8_t max_length,
+    struct _bit_writer *);
+
+/* Decode exactly size bytes into dst. Returns false if src is malformed
+ * or shorter than the codes.  */
+static HUFFMAN_INLINE bool
+_decode_using_table(uint8_t const * src, size_t n, uint8_t * dst,
+    size_t size, struct _decode_table const *);
+
+/* Same as _decode_using_table for HUFFMAN_STREAMS streams of src of sizes
+ * n, each one decoded into its segment of dst.  */
+static HUFFMAN_INLINE bool
+_decode_interleaved(uint8_t const * const * src, size_t const * n,
+    uint8_t * dst, size_t size, struct _decode_table const *);
+
+static HUFFMAN_INLINE void
+_init_reader(struct _bit_reader *, uint8_t const * src, size_t n);
+
+/* Decode one symbol. Returns false if bits are not a code.  */
+static HUFFMAN_INLINE bool
+_decode_symbol(struct _bit_reader *, struct _decode_table const *,
+    uint8_t * symbol);
+
+/* Decode size symbols into dst, refilling reader as needed.  */
+static HUFFMAN_INLINE bool
+_decode_symbols(struct _bit_reader *, uint8_t * dst, size_t size,
+    struct _decode_table const *);
+
+/* Drop skip symbols, then decode size bytes into dst with table, or with
+ * context model unless it is NULL. Returns false if src is malformed or
+ * shorter than the codes.  */
+static bool
+_decode_slice(uint8_t const * src, size_t n, size_t skip, uint8_t * dst,
+    size_t size, struct _decode_table const *,
+    struct _context_model const *);
+
+/* Number of streams of block of given type for n bytes of input and sync
+ * interval. Number of symbols in each stream but the last one is stored
+ * into segment.  */
+static size_t
+_stream_count(uint8_t type, size_t n, size_t interval, size_t * segment);
+
+/* Bytes taken by sync interval and sizes of streams of block of given type,
+ * plus at most one byte of padding of every stream but the last.  */
+static size_t
+_streams_overhead(uint8_t type, size_t n, size_t interval,
+    uint8_t max_length);
+
+/* Code n bytes of src into bitstreams at out as laid out by block type,
+ * preceded by sync interval if there is one and sizes of all streams but
+ * the last one. Codes are those of table, or of context model unless it is
+ * NULL. Returns number of bytes written or HUFFMAN_ERROR if they do not fit
+ * into cap bytes.  */
+static size_t
+_encode_streams(uint8_t const * src, size_t n,
+    struct _encode_entry const * table, uint8_t max_length, uint8_t type,
+    size_t interval, uint8_t * out, size_t cap,
+    struct _context_model const *);
+
+/* Read layout of streams of block of given type and size from n bytes of
+ * in following its header. Returns false if in is malformed.  */
+static bool
+_read_layout(uint8_t type, uint8_t const * in, size_t n, size_t size,
+    uint8_t max_length, struct _stream_layout *);
+
+/* Find the next stream of layout. Returns false if its size is out of
+ * bounds.  */
+static bool
+_next_stream(struct _stream_layout *, uint8_t const ** stream, size_t * n);
+
+/* Decode size bytes into dst from n bytes of in following header of block
+ * of given type, i.e. from one stream or from sizes of streams and the
+ * streams themselves, with table or with context model unless it is NULL.
+ * Returns false if in is malformed.  */
+static bool
+_decode_streams(uint8_t type, uint8_t const * in, size_t n, uint8_t * dst,
+    size_t size, struct _decode_table const *,
+    struct _context_model const *);
+
+/* Same as _decode_streams for length bytes from offset only, decoding the
+ * streams covering them.  */
+static bool
+_decode_streams_range(uint8_t type, uint8_t const * in, size_t n,
+    size_t size, size_t offset, size_t length, uint8_t * dst,
+    struct _decode_table const *, struct _context_model const *);
+
+/* Context coding operations.  */
+
+/* Allocate context model of ctx unless it has one. Returns false if there
+ * is not enough memory.  */
+static bool
+_ensure_model(struct huffman_ctx *);
+
+/* Count bytes of n bytes of src by context, each stream of block of given
+ * type starting in context 0.  */
+static void
+_count_contexts(uint8_t const * src, size_t n, uint8_t type,
+    size_t interval, struct _context_model *);
+
+/* Group contexts of counted model into up to clusters clusters and build
+ * their codes of up to max_code_length bits using tree t. Returns size of
+ * codes in bytes.  */
+static uint64_t
+_cluster_contexts(struct _context_model *, uint8_t clusters,
+    uint8_t max_code_length, struct huffman_tree * t);
+
+/* Compress n bytes of src with context codes into dst of cap bytes if they
+ * come out shorter than limit bytes. Returns compressed size, 0 if they do
+ * not or HUFFMAN_ERROR if they do not fit into dst.  */
+static size_t
+_compress_context(struct huffman_ctx *, uint8_t const * src, size_t n,
+    uint8_t layout, size_t limit, uint8_t * dst, size_t cap);
+
+/* Serialize clusters and code lengths of model into out, which must have
+ * room for HUFFMAN_MAX_CONTEXT_HEADER_SIZE bytes. Returns number of bytes
+ * written.  */
+static size_t
+_write_context_model(struct _context_model const *, uint8_t * out);
+
+/* Restore model written by _write_context_model from n bytes of in and
+ * build its tables. Returns number of bytes read or 0 if in is
+ * malformed.  */
+static size_t
+_read_context_model(uint8_t const * in, size_t n, struct _context_model *);
+
+/* Build encode tables, single probe decode tables or both for clusters of
+ * model from their code lengths. Returns false if lengths of some cluster
+ * do not form a prefix code, are longer than HUFFMAN_TABLE_BITS or are
+ * all zero.  */
+static bool
+_build_context_tables(struct _context_model *, bool encoding, bool decoding);
+
+static HUFFMAN_INLINE void
+_encode_context(uint8_t const * src, size_t n,
+    struct _context_model const *, struct _bit_writer *);
+
+/* Decode a symbol with table of context of the previous one, which it
+ * replaces.  */
+static HUFFMAN_INLINE bool
+_decode_context_symbol(struct _bit_reader *, struct _context_model const *,
+    uint8_t * previous);
+
+/* Decode size symbols into dst, each with table of context of the previous
+ * one, which is updated.  */
+static HUFFMAN_INLINE bool
+_decode_context_symbols(struct _bit_reader *, uint8_t * dst, size_t size,
+    struct _context_model const *, uint8_t * previous);
+
+/* Same as _decode_interleaved with context model.  */
+static bool
+_decode_context_interleaved(uint8_t const * const * src, size_t const * n,
+    uint8_t * dst, size_t size, struct _context_model const *);
+
+/* Create table with codes of up to max_code_length bits for counts, to
+ * which one is added first, so that every byte value gets a code.  */
+static struct huffman_table *
+_train_table(uint64_t * counts, uint32_t id, uint8_t max_code_length);
+
+/* Allocate table with given id and lengths and build its encode and
+ * decode tables. Returns NULL if some byte value has no code, lengths do
+ * not form a prefix code or there is not enough memory.  */
+static struct huffman_table *
+_create_table(uint32_t id, uint8_t const * lengths);
+
+/* Build codes of adaptive state from its counts, and the table used for
+ * encoding or decoding, or both of them.  */
 static void
-_swap(struct _huffman_tree_node *, struct _huffman_tree_node *);
+_adaptive_build(struct huffman_adaptive *, bool encoding, bool decoding);
+
+/* Add n coded bytes of src to counts of adaptive state, which must not be
+ * past the next rebuild, and rebuild codes when it is reached.  */
+static void
+_adaptive_update(struct huffman_adaptive *, uint8_t const * src, size_t n,
+    bool decoding);
+
+/* Whether code table of given lengths fits counts of n bytes well enough
+ * to be repeated. All counted byte values must have codes.  */
+static bool
+_can_repeat(uint64_t const * counts, uint8_t const * lengths, size_t n);
+
+/* Size of codes for given counts and code lengths in bytes, if they were
+ * coded into one stream.  */
+static uint64_t
+_coded_size(uint64_t const * counts, uint8_t const * lengths);
+
+/* Number of bytes stream sizes of interleaved block take: enough for any
+ * stream of segment symbols with codes of up to max_length bits.  */
+static uint8_t
+_stream_size_width(size_t segment, uint8_t max_length);
+
+/* Variable length (7 bits per byte) integer operations.  */
+
+static size_t
+_write_varint(uint8_t * out, uint64_t value);
+
+/* Returns number of bytes read or 0 if input is malformed.  */
+static size_t
+_read_varint(uint8_t const * in, size_t n, uint64_t * value);
 
 #endif
@@ -1,93 +1,387 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
 
-#include "./huffman.h"
+#include "./huf.h"
 
 
-void print_frequencies(struct huffman_tree *);
+struct options {
+    bool                decompress;
+    bool                to_stdout;
+    bool                force;
+    bool                stats;
+    bool                range;
+    uint64_t            offset, length;     /* Of range to decompress.  */
+    char const *        input;      /* NULL or "-" for stdin.  */
+    char const *        output;     /* NULL to derive from input.  */
+    struct huf_options  huf;
+};
 
-void print_huffman_codes(struct huffman_tree *);
 
+void print_usage(FILE *);
 
-int main(void) {
-    char const * string = "Lorem ipsum dolor sit amet, consectetur adipiscing"
-    " elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua"
-    ". Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nis"
-    "i ut aliquip ex ea commodo consequat. Duis aute irure dolor in reprehend"
-    "erit in voluptate velit esse cillum dolore eu fugiat nulla pariatur. Exc"
-    "epteur sint occaecat cupidatat non proident, sunt in culpa qui officia d"
-    "eserunt mollit anim id est laborum.";
+/* Parse number with optional K or M suffix. Returns end of it through
+ * end.  */
+bool parse_number(char const *, char const ** end, uint64_t *);
 
-    // char const * string = "Lorem ipsum dolor sit amet, consectetur adipiscing"
-    // " elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua"    
-    // ". Ut enim ad minim veniam, quis nostrud";
+bool parse_size(char const *, uint32_t *);
 
-    // char const * string = "abcdefghijklmnopqrstuvwxyz";
+/* Parse OFFSET:LENGTH, LENGTH may be omitted to take the rest of data.  */
+bool parse_range(char const *, uint64_t * offset, uint64_t * length);
 
-    // char const * string = "abcd";
+void print_stats(FILE *, struct huffman_stats const *);
 
-    // char const * string = "abababababababab";
+/* Derive output name from input name: append .huf when compressing, strip
+ * it when decompressing. Returns NULL if input has no .huf extension.  */
+char * output_name(char const * input, bool decompress);
 
-    // char const * string = "cdadbcdd";
 
-    // char const * string = "caedbeabedceac";
+int main(int argc, char ** argv) {
+    struct options o;
+    memset(&o, 0, sizeof(o));
+    huf_default_options(&o.huf);
 
-    // struct huffman_tree * t = huffman(string);
+    /* Long options have no short equivalents.  */
+    enum { OPTION_STATS = 256, OPTION_RANGE };
+    static struct option const long_options[] = {
+        { "stats", no_argument, NULL, OPTION_STATS },
+        { "range", required_argument, NULL, OPTION_RANGE },
+        { NULL, 0, NULL, 0 }
+    };
 
-    // print_frequencies(t);
-    // print_huffman_codes(t);
-    // printf("\n");
+    int c;
+    uint32_t value;
+    while ((c = getopt_long(argc, argv, "dcfo:a:b:k:C:L:RS:T:h", long_options,
+            NULL)) != -1) {
+        switch (c) {
+            case 'd': o.decompress  = true;     break;
+            case 'c': o.to_stdout   = true;     break;
+            case 'f': o.force       = true;     break;
+            case 'o': o.output      = optarg;   break;
 
-    uint64_t size;
-    uint8_t * alphabet;
-    uint8_t * compressed_string = compress_huffman(string, &size, &alphabet);
+            case 'a':
+                if (!parse_size(optarg, &o.huf.adaptive_interval)) {
+                    fprintf(stderr, "huf: invalid interval '%s'\n", optarg);
+                    return 2;
+                }
+                break;
 
-    char * decompressed_string = \
-        decompress_huffman(compressed_string, strlen(string), alphabet);
+            case 'b':
+                if (!parse_size(optarg, &o.huf.block_size)) {
+                    fprintf(stderr, "huf: invalid block size '%s'\n", optarg);
+                    return 2;
+                }
+                break;
 
-    uint8_t counter     = alphabet[0];
-    uint8_t memb_size   = alphabet[1];
+            case 'k':
+                if (!parse_size(optarg, &o.huf.sync_interval)) {
+                    fprintf(stderr, "huf: invalid sync interval '%s'\n",
+                        optarg);
+                    return 2;
+                }
+                break;
 
-    printf("\tInput string:\n\"%s\"\n\n", string);
+            case 'C':
+                if (!parse_size(optarg, &value) || value < 2
+                        || value > HUFFMAN_MAX_CLUSTERS) {
+                    fprintf(stderr, "huf: invalid number of tables '%s'\n",
+                        optarg);
+                    return 2;
+                }
 
-    printf("\tCompressed string:\n[");
-    for (uint64_t i = 0; i < size; ++i) {
-        printf("%c", compressed_string[i]);
-    }   printf("]\n\n");
+                o.huf.clusters = value;
+                break;
 
-    printf("\tDecompressed string:\n\"%s\"\n\n", decompressed_string);
+            case 'L':
+                if (!parse_size(optarg, &value)
+                        || value < HUFFMAN_MIN_CODE_LENGTH_LIMIT
+                        || value > HUFFMAN_MAX_DECODE_LENGTH) {
+                    fprintf(stderr, "huf: invalid max code length '%s'\n",
+                        optarg);
+                    return 2;
+                }
 
-    printf("Compression (raw):\t\tx%.2f\n", (float)strlen(string) / size);
-    printf("Compression (with alphabet):\tx%.2f\n",
-        (float)strlen(string) / (size + (counter * (memb_size + 1)) + 3));
-    printf("Alphabet size:\t\t\t%d\n", counter);
-    printf("Max bytes for code:\t\t%d\n", memb_size);
+                o.huf.max_code_length = value;
+                break;
 
-    return 0;
+            case 'R':
+                o.huf.repeat = true;
+                break;
+
+            case 'S':
+                if (!parse_size(optarg, &value)
+                        || (value != 1 && value != HUFFMAN_STREAMS)) {
+                    fprintf(stderr, "huf: invalid number of streams '%s'\n",
+                        optarg);
+                    return 2;
+                }
+
+                o.huf.streams = value;
+                break;
+
+            case 'T':
+                if (!parse_size(optarg, &value) || value > HUF_MAX_THREADS) {
+                    fprintf(stderr, "huf: invalid number of threads '%s'\n",
+                        optarg);
+                    return 2;
+                }
+
+                o.huf.threads = value;
+                break;
+
+            case OPTION_STATS:
+#ifndef HUFFMAN_STATS
+                fprintf(stderr, "huf: built without statistics, "
+                    "rebuild with make STATS=1\n");
+                return 2;
+#endif
+                o.stats = true;
+                break;
+
+            case OPTION_RANGE:
+                if (!parse_range(optarg, &o.offset, &o.length)) {
+                    fprintf(stderr, "huf: invalid range '%s'\n", optarg);
+                    return 2;
+                }
+
+                o.range         = true;
+                o.decompress    = true;
+                break;
+
+            case 'h':
+                print_usage(stdout);
+                return 0;
+
+            default:
+                print_usage(stderr);
+                return 2;
+        }
+    }
+
+    if (argc - optind > 1) {
+        print_usage(stderr);
+        return 2;
+    }
+
+    if (optind < argc && strcmp(argv[optind], "-") != 0)
+        o.input = argv[optind];
+
+    FILE * in = stdin;
+    if (o.input != NULL && (in = fopen(o.input, "rb")) == NULL) {
+        perror(o.input);
+        return 1;
+    }
+
+    /* Slice is not the original file, so it is named by -o only.  */
+    if (o.range && o.output == NULL)
+        o.to_stdout = true;
+
+    /* Without input file there is nothing to derive output name from.  */
+    char * derived = NULL;
+    if (o.output == NULL && !o.to_stdout && o.input != NULL) {
+        derived = output_name(o.input, o.decompress);
+        if (derived == NULL) {
+            fprintf(stderr, "huf: %s: unknown extension, use -o or -c\n",
+                o.input);
+            return 1;
+        }
+
+        o.output = derived;
+    }
+
+    FILE * out = stdout;
+    if (o.output != NULL && !o.to_stdout) {
+        if (!o.force && access(o.output, F_OK) == 0) {
+            fprintf(stderr, "huf: %s already exists, use -f to overwrite\n",
+                o.output);
+            return 1;
+        }
+
+        /* Opened for reading too, so that it can be mapped.  */
+        if ((out = fopen(o.output, "w+b")) == NULL) {
+            perror(o.output);
+            return 1;
+        }
+    }
+
+    struct huffman_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (o.stats)
+        o.huf.stats = &stats;
+
+    enum huf_status status = o.range
+        ? huf_decompress_range(in, out, o.offset, o.length, o.huf.stats)
+        : o.decompress
+        ? huf_decompress_file(in, out, o.huf.threads, o.huf.stats)
+        : huf_compress_file(in, out, &o.huf);
+
+    if (in != stdin)
+        fclose(in);
+
+    if (out != stdout && fclose(out) != 0 && status == HUF_OK)
+        status = HUF_ERROR_WRITE;
+
+    if (status != HUF_OK) {
+        fprintf(stderr, "huf: %s\n", huf_status_string(status));
+
+        /* Do not leave partial output behind.  */
+        if (out != stdout)
+            remove(o.output);
+    }
+
+    else if (o.stats)
+        print_stats(stderr, &stats);
+
+    free(derived);
+
+    return status == HUF_OK ? 0 : 1;
+}
+
+
+void print_usage(FILE * f) {
+    fprintf(f,
+        "Usage: huf [-d] [-c | -o FILE] [-f] [-a SIZE] [-b SIZE] [-k SIZE]\n"
+        "           [-C N] [-L BITS] [-R] [-S N] [-T N]\n"
+        "           [--range OFFSET:[LENGTH]] [--stats] [FILE]\n"
+        "Compress FILE into FILE.huf, or decompress FILE.huf into FILE.\n"
+        "Without FILE or with FILE '-' read stdin and write stdout.\n"
+        "\n"
+        "  -d       decompress\n"
+        "  -c       write to stdout\n"
+        "  -o FILE  write to FILE\n"
+        "  -f       overwrite existing output\n"
+        "  -a SIZE  adaptive codes rebuilt at most every SIZE bytes, a power\n"
+        "           of two from 256 to 1M: input is coded and written as it\n"
+        "           comes, without tables; -k, -C, -R, -S and -T do not\n"
+        "           apply\n"
+        "  -b SIZE  block size, with optional K or M suffix (default 256K)\n"
+        "  -k SIZE  sync points every SIZE bytes of a block, at least 1K,\n"
+        "           for finer --range (default none)\n"
+        "  -C N     code each byte by the previous one with up to N tables,\n"
+        "           2 to 16, where it makes blocks smaller (default off)\n"
+        "  -L BITS  max code length, 8 to 56 (default 11)\n"
+        "  -R       repeat code table of the previous block when it fits,\n"
+        "           blocks are then compressed by one thread\n"
+        "  -S N     streams per block, 1 or 4 (default 4)\n"
+        "  -T N     use N threads, up to 256, 0 for one per processor\n"
+        "           (default 1)\n"
+        "  --range OFFSET:[LENGTH]\n"
+        "           decompress LENGTH bytes from OFFSET only, or the rest\n"
+        "           without LENGTH, into stdout unless -o is given; FILE must\n"
+        "           be a regular file\n"
+        "  --stats  print time of each phase and statistics of blocks to\n"
+        "           stderr, if built with make STATS=1\n"
+        "  -h       show this help\n");
 }
 
 
-void print_frequencies(struct huffman_tree * t) {
-    uint64_t * counts = get_char_frequencies(t);
+void print_stats(FILE * f, struct huffman_stats const * s) {
+    /* Phases of several threads overlap, so times are summed over threads
+     * and may exceed wall time.  */
+    fprintf(f,
+        "histogram       %12.3f ms\n"
+        "build           %12.3f ms\n"
+        "encode          %12.3f ms\n"
+        "decode          %12.3f ms\n"
+        "io              %12.3f ms\n",
+        s->histogram_ns / 1e6, s->build_ns / 1e6, s->encode_ns / 1e6,
+        s->decode_ns / 1e6, s->io_ns / 1e6);
+
+    fprintf(f,
+        "bytes in        %12llu\n"
+        "bytes out       %12llu\n"
+        "header bytes    %12llu\n"
+        "max code length %12u\n"
+        "max symbols     %12u\n"
+        "allocations     %12llu\n",
+        (unsigned long long)s->bytes_in, (unsigned long long)s->bytes_out,
+        (unsigned long long)s->header_bytes, s->max_code_length,
+        s->max_symbols, (unsigned long long)s->allocations);
+
+    static char const * const types[HUFFMAN_BLOCK_TYPES] = {
+        "coded", "raw", "rle", "repeat", "static", "context"
+    };
+
+    for (uint8_t k = 0; k < HUFFMAN_BLOCK_TYPES; ++k)
+        fprintf(f, "%-7s blocks  %12llu\n", types[k],
+            (unsigned long long)s->blocks[k]);
+}
+
+
+bool parse_number(char const * s, char const ** end, uint64_t * number) {
+    char * next;
+    unsigned long long value = strtoull(s, &next, 10);
+
+    /* Sign is not a digit.  */
+    if (next == s || *s < '0' || *s > '9')
+        return false;
+
+    uint8_t shift = 0;
+    if (*next == 'K' || *next == 'k')
+        shift = 10;
+
+    else if (*next == 'M' || *next == 'm')
+        shift = 20;
+
+    if (value > UINT64_MAX >> shift)
+        return false;
 
-    for (uint64_t i = 0; i < DEFAULT_HEAP_SIZE; ++i) {
-        if (counts[i] == 0)
-            continue;
+    *number = (uint64_t)value << shift;
+    *end    = next + (shift != 0);
 
-        printf("[\'%c\':%d], ", (char)i, counts[i]);
+    return true;
+}
+
+
+bool parse_size(char const * s, uint32_t * size) {
+    char const * end;
+    uint64_t value;
+
+    if (!parse_number(s, &end, &value) || *end != '\0' || value > UINT32_MAX)
+        return false;
+
+    *size = value;
+
+    return true;
+}
+
+
+bool parse_range(char const * s, uint64_t * offset, uint64_t * length) {
+    char const * end;
+
+    if (!parse_number(s, &end, offset) || *end != ':')
+        return false;
+
+    if (end[1] == '\0') {
+        *length = UINT64_MAX;
+        return true;
     }
 
-    printf("\n");
+    return parse_number(end + 1, &end, length) && *end == '\0';
 }
 
 
-void print_huffman_codes(struct huffman_tree * t) {
-    char * chars;
-    uint8_t size, memb_size;
+char * output_name(char const * input, bool decompress) {
+    size_t length           = strlen(input);
+    size_t extension_length = strlen(HUF_EXTENSION);
+
+    if (!decompress) {
+        char * name = malloc(length + extension_length + 1);
+        memcpy(name, input, length);
+        memcpy(name + length, HUF_EXTENSION, extension_length + 1);
+        return name;
+    }
+
+    if (length <= extension_length
+            || strcmp(input + length - extension_length, HUF_EXTENSION) != 0)
+        return NULL;
 
-    char ** codes = get_huffman_codes(t, &chars, &size, &memb_size);
+    char * name = malloc(length - extension_length + 1);
+    memcpy(name, input, length - extension_length);
+    name[length - extension_length] = '\0';
 
-    printf("Codes:\n");
-    for (uint16_t i = 0; i < size; ++i)
-        printf("%c : %s\n", chars[i], codes[i]);
+    return name;
 }
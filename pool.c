@@ -0,0 +1,235 @@
+#include <unistd.h>
+
+#include "./pool.h"
+
+
+#define DEFAULT_QUEUE_SIZE  16  /* Must belong to (0, UINT32_MAX).  */
+
+
+struct _pool_task {
+    pool_task   run;
+    void *      arg;
+};
+
+
+/* Ring buffer of tasks, grows when full.  */
+struct _pool_queue {
+    pthread_mutex_t     lock;
+    struct _pool_task * tasks;
+    uint32_t            first, size, max_size;
+};
+
+
+struct pool {
+    pthread_t *             threads;
+    struct _pool_queue *    queues;
+    unsigned                size;   /* Number of queues.  */
+    unsigned                count;  /* Number of started workers.  */
+
+    /* Workers sleep on wake while there are no pending tasks.  */
+    pthread_mutex_t         lock;
+    pthread_cond_t          wake;
+    uint64_t                pending;
+    unsigned                next_queue;
+    bool                    stop;
+};
+
+
+struct _pool_worker_arg {
+    struct pool *   pool;
+    unsigned        index;
+};
+
+
+struct pool *
+pool_create(unsigned threads) {
+    if (threads == 0)
+        return NULL;
+
+    struct pool * p = calloc(1, sizeof(struct pool));
+    if (p == NULL)
+        return NULL;
+
+    p->threads  = calloc(threads, sizeof(pthread_t));
+    p->queues   = calloc(threads, sizeof(struct _pool_queue));
+    if (p->threads == NULL || p->queues == NULL) {
+        free(p->threads);
+        free(p->queues);
+        free(p);
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    p->size = threads;
+
+    for (unsigned i = 0; i < threads; ++i)
+        pthread_mutex_init(&p->queues[i].lock, NULL);
+
+    for (unsigned i = 0; i < threads; ++i) {
+        struct _pool_queue * q = p->queues + i;
+        q->tasks    = calloc(DEFAULT_QUEUE_SIZE, sizeof(struct _pool_task));
+        q->max_size = DEFAULT_QUEUE_SIZE;
+
+        if (q->tasks == NULL) {
+            pool_free(p);
+            return NULL;
+        }
+    }
+
+    /* Workers which failed to start are not counted, pool_free waits for
+     * the started ones only.  */
+    for (unsigned i = 0; i < threads; ++i) {
+        struct _pool_worker_arg * arg = malloc(sizeof(*arg));
+        if (arg == NULL)
+            break;
+
+        arg->pool   = p;
+        arg->index  = i;
+
+        if (pthread_create(p->threads + i, NULL, _pool_worker, arg) != 0) {
+            free(arg);
+            break;
+        }
+
+        p->count = i + 1;
+    }
+
+    if (p->count == 0) {
+        pool_free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+
+unsigned
+pool_threads(struct pool const * p) {
+    return p->count;
+}
+
+
+bool
+pool_submit(struct pool * p, pool_task task, void * arg) {
+    /* Tasks are spread over queues round robin.  */
+    pthread_mutex_lock(&p->lock);
+    struct _pool_queue * q = p->queues + p->next_queue;
+    p->next_queue = (p->next_queue + 1) % p->count;
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->size == q->max_size) {
+        struct _pool_task * tasks = \
+            calloc(2 * q->max_size, sizeof(struct _pool_task));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&q->lock);
+            return false;
+        }
+
+        for (uint32_t i = 0; i < q->size; ++i)
+            tasks[i] = q->tasks[(q->first + i) % q->max_size];
+
+        free(q->tasks);
+        q->tasks    = tasks;
+        q->first    = 0;
+        q->max_size *= 2;
+    }
+
+    q->tasks[(q->first + q->size++) % q->max_size] = \
+        (struct _pool_task){ task, arg };
+
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&p->lock);
+    ++p->pending;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    return true;
+}
+
+
+void
+pool_free(struct pool * p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    for (unsigned i = 0; i < p->count; ++i)
+        pthread_join(p->threads[i], NULL);
+
+    for (unsigned i = 0; i < p->size; ++i) {
+        pthread_mutex_destroy(&p->queues[i].lock);
+        free(p->queues[i].tasks);
+    }
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    free(p->threads);
+    free(p->queues);
+    free(p);
+}
+
+
+unsigned
+pool_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+}
+
+
+static void *
+_pool_worker(void * a) {
+    struct _pool_worker_arg arg = *(struct _pool_worker_arg *)a;
+    free(a);
+
+    struct pool * p = arg.pool;
+
+    for (;;) {
+        /* Wait for a task to be pending and claim it, so that another
+         * worker does not wait for the same one.  */
+        pthread_mutex_lock(&p->lock);
+        while (p->pending == 0 && !p->stop)
+            pthread_cond_wait(&p->wake, &p->lock);
+
+        if (p->pending == 0) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+
+        --p->pending;
+        pthread_mutex_unlock(&p->lock);
+
+        /* Own queue first, then steal from the others. The claimed task is
+         * somewhere in queues, but may be taken from under our nose by a
+         * worker which claimed another one, so keep looking.  */
+        struct _pool_task task;
+        for (unsigned i = 0; ; i = (i + 1) % p->size)
+            if (_pool_pop(p->queues + (arg.index + i) % p->size, &task))
+                break;
+
+        task.run(task.arg, arg.index);
+    }
+
+    return NULL;
+}
+
+
+static bool
+_pool_pop(struct _pool_queue * q, struct _pool_task * task) {
+    pthread_mutex_lock(&q->lock);
+
+    bool found = q->size > 0;
+    if (found) {
+        *task = q->tasks[q->first];
+        q->first = (q->first + 1) % q->max_size;
+        --q->size;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return found;
+}
@@ -0,0 +1,55 @@
+#ifndef HUF_THREAD_POOL
+#define HUF_THREAD_POOL
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+
+/* ________ "Public" functions and structures. ________ */
+
+/* Pool of worker threads. Every worker has its own queue of tasks; a
+ * worker whose queue is empty steals tasks from queues of others.  */
+struct pool;
+
+/* Task gets its argument and index of the worker running it, which is
+ * less than number of threads of the pool, so that tasks can use
+ * per-worker state without locking.  */
+typedef void (* pool_task)(void * arg, unsigned worker);
+
+/* Start pool of threads workers. Returns NULL on failure.  */
+struct pool *
+pool_create(unsigned threads);
+
+unsigned
+pool_threads(struct pool const *);
+
+/* Queue task. Returns false if there is not enough memory.  */
+bool
+pool_submit(struct pool *, pool_task task, void * arg);
+
+/* Wait for all queued tasks to finish, stop and free the pool.  */
+void
+pool_free(struct pool *);
+
+/* Number of online processors, at least 1.  */
+unsigned
+pool_default_threads(void);
+
+
+/* ________ "Private"  functions and structures. ________ */
+
+struct _pool_task;
+
+struct _pool_queue;
+
+static void *
+_pool_worker(void *);
+
+/* Take the oldest task of queue q. Returns false if q is empty.  */
+static bool
+_pool_pop(struct _pool_queue * q, struct _pool_task * task);
+
+#endif
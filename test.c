@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./huffman.h"
+
+
+/* Every supported kernel must produce the same compressed data and decode
+ * data of any other kernel, as files are written and read on different
+ * machines.  */
+
+#define INPUT_SIZE          ((size_t)256 << 10)
+#define SYNC_INTERVAL       ((size_t)4 << 10)
+#define RANGES              8
+#define CHUNKS              5   /* Of adaptive coding.  */
+
+#define SEED                0x9E3779B97F4A7C15ull
+
+
+struct input {
+    char const *    name;
+    uint8_t *       data;
+    size_t          size;
+};
+
+
+/* Settings of one compression, see huffman_ctx_set_*.  */
+struct settings {
+    uint8_t     streams;
+    uint8_t     max_code_length;
+    uint8_t     clusters;
+    size_t      sync_interval;
+};
+
+
+/* Buffers shared by all checks.  */
+struct buffers {
+    uint8_t *   reference;      /* Output of the first kernel.  */
+    uint8_t *   packed;
+    uint8_t *   unpacked;
+    size_t      bound;
+};
+
+
+uint64_t next_random(uint64_t * state);
+
+/* Input generators, deterministic for given state.  */
+
+void fill_uniform(uint8_t * dst, size_t n, uint64_t * state);
+
+/* Byte value k with probability 2^-(k + 1), whose codes are as long as
+ * input allows, so that every limit of code length cuts them.  */
+void fill_geometric(uint8_t * dst, size_t n, uint64_t * state);
+
+/* Lower case letters and spaces, each letter mostly followed by few
+ * others, so that context codes pay off.  */
+void fill_text(uint8_t * dst, size_t n, uint64_t * state);
+
+/* Compress src with settings by every supported kernel, check that outputs
+ * are identical and that every kernel decodes them back, whole and by
+ * ranges. Prints what differs. Returns number of failed checks.  */
+unsigned check_settings(struct input const *, struct settings const *,
+    struct buffers *, unsigned * checks);
+
+/* Same for adaptive coding of src in CHUNKS chunks with codes of up to
+ * max_code_length bits.  */
+unsigned check_adaptive(struct input const *, uint8_t max_code_length,
+    struct buffers *, unsigned * checks);
+
+/* Decompress packed by kernel and compare with src, whole and by ranges.
+ * Returns number of failed checks.  */
+unsigned check_decode(struct huffman_ctx *, enum huffman_kernel,
+    struct input const *, struct settings const *, uint8_t const * packed,
+    size_t size, struct buffers *, unsigned * checks);
+
+void print_settings(FILE *, struct input const *, struct settings const *);
+
+
+int main(void) {
+    uint64_t state = SEED;
+
+    struct input inputs[] = {
+        { "uniform",    NULL, INPUT_SIZE },
+        { "geometric",  NULL, INPUT_SIZE },
+        { "text",       NULL, INPUT_SIZE },
+        { "short",      NULL, 1000 },
+        { "tiny",       NULL, 7 },
+    };
+
+    size_t const count = sizeof(inputs) / sizeof(inputs[0]);
+
+    struct huffman_adaptive * a = huffman_adaptive_create();
+    struct buffers b;
+    b.bound = huffman_compress_bound(INPUT_SIZE);
+    if (a != NULL && huffman_adaptive_bound(a, INPUT_SIZE) > b.bound)
+        b.bound = huffman_adaptive_bound(a, INPUT_SIZE);
+
+    bool allocated = a != NULL;
+    huffman_adaptive_free(a);
+
+    b.reference = malloc(b.bound);
+    b.packed    = malloc(b.bound);
+    b.unpacked  = malloc(INPUT_SIZE);
+    allocated   = allocated && b.reference != NULL && b.packed != NULL
+        && b.unpacked != NULL;
+
+    for (size_t i = 0; i < count; ++i) {
+        inputs[i].data  = malloc(inputs[i].size);
+        allocated       = allocated && inputs[i].data != NULL;
+    }
+
+    if (!allocated) {
+        fprintf(stderr, "test: not enough memory\n");
+        return 1;
+    }
+
+    fill_uniform(inputs[0].data, inputs[0].size, &state);
+    fill_geometric(inputs[1].data, inputs[1].size, &state);
+    fill_text(inputs[2].data, inputs[2].size, &state);
+    fill_text(inputs[3].data, inputs[3].size, &state);
+    fill_geometric(inputs[4].data, inputs[4].size, &state);
+
+    enum huffman_kernel selected = huffman_get_kernel();
+    printf("kernels:");
+    for (enum huffman_kernel k = 0; k < HUFFMAN_KERNELS; ++k)
+        if (huffman_set_kernel(k))
+            printf(" %s", huffman_kernel_name(k));
+
+    printf("\n");
+    huffman_set_kernel(selected);
+
+    unsigned failures = 0, checks = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        for (uint8_t length = HUFFMAN_MIN_CODE_LENGTH_LIMIT;
+                length <= HUFFMAN_MAX_DECODE_LENGTH; ++length) {
+            struct settings s;
+
+            for (s.streams = 1; s.streams <= HUFFMAN_STREAMS;
+                    s.streams += HUFFMAN_STREAMS - 1) {
+                s.max_code_length   = length;
+                s.clusters          = 0;
+                s.sync_interval     = 0;
+                failures += check_settings(inputs + i, &s, &b, &checks);
+
+                s.sync_interval     = SYNC_INTERVAL;
+                failures += check_settings(inputs + i, &s, &b, &checks);
+
+                /* Clustering takes time, a few limits will do.  */
+                if (length % 8 != 0 && length != HUFFMAN_TABLE_BITS)
+                    continue;
+
+                s.clusters          = HUFFMAN_MAX_CLUSTERS;
+                s.sync_interval     = 0;
+                failures += check_settings(inputs + i, &s, &b, &checks);
+
+                s.sync_interval     = SYNC_INTERVAL;
+                failures += check_settings(inputs + i, &s, &b, &checks);
+            }
+
+            failures += check_adaptive(inputs + i, length, &b, &checks);
+        }
+    }
+
+    huffman_set_kernel(selected);
+
+    for (size_t i = 0; i < count; ++i)
+        free(inputs[i].data);
+
+    free(b.reference);
+    free(b.packed);
+    free(b.unpacked);
+
+    printf("%u checks, %u failed\n", checks, failures);
+
+    return failures == 0 ? 0 : 1;
+}
+
+
+uint64_t next_random(uint64_t * state) {
+    /* xorshift64*  */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+
+void fill_uniform(uint8_t * dst, size_t n, uint64_t * state) {
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = next_random(state) >> 56;
+}
+
+
+void fill_geometric(uint8_t * dst, size_t n, uint64_t * state) {
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t r = next_random(state) | (uint64_t)1 << 63;
+        dst[i] = __builtin_ctzll(r);
+    }
+}
+
+
+void fill_text(uint8_t * dst, size_t n, uint64_t * state) {
+    uint8_t previous = ' ';
+
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t r = next_random(state);
+
+        /* Next letter is one of four after the previous one, words end
+         * about every sixth letter.  */
+        if (previous != ' ' && r % 6 == 0)
+            dst[i] = ' ';
+        else if (previous == ' ')
+            dst[i] = 'a' + (r >> 8) % 26;
+        else
+            dst[i] = 'a' + (previous - 'a' + 1 + (r >> 8) % 4) % 26;
+
+        previous = dst[i];
+    }
+}
+
+
+unsigned check_settings(struct input const * in, struct settings const * s,
+    struct buffers * b, unsigned * checks)
+{
+    struct huffman_ctx * ctx = huffman_ctx_create();
+    if (ctx == NULL) {
+        fprintf(stderr, "test: not enough memory\n");
+        return 1;
+    }
+
+    unsigned failures = 0;
+    size_t size = HUFFMAN_ERROR;
+
+    for (enum huffman_kernel k = 0; k < HUFFMAN_KERNELS; ++k) {
+        if (!huffman_set_kernel(k))
+            continue;
+
+        huffman_ctx_reset(ctx);
+        huffman_ctx_set_streams(ctx, s->streams);
+        huffman_ctx_set_max_code_length(ctx, s->max_code_length);
+        huffman_ctx_set_clusters(ctx, s->clusters);
+        huffman_ctx_set_sync_interval(ctx, s->sync_interval);
+
+        size_t packed_size = huffman_compress_ctx(ctx, in->data, in->size,
+            b->packed, b->bound);
+
+        ++*checks;
+        if (packed_size == HUFFMAN_ERROR) {
+            print_settings(stderr, in, s);
+            fprintf(stderr, "%s: compression failed\n",
+                huffman_kernel_name(k));
+            ++failures;
+            break;
+        }
+
+        if (size == HUFFMAN_ERROR) {
+            size = packed_size;
+            memcpy(b->reference, b->packed, size);
+        }
+
+        else if (packed_size != size
+                || memcmp(b->packed, b->reference, size) != 0) {
+            print_settings(stderr, in, s);
+            fprintf(stderr, "%s: output differs from %s\n",
+                huffman_kernel_name(k), huffman_kernel_name(0));
+            ++failures;
+        }
+    }
+
+    /* Output of the first kernel decoded by each one, so that every pair
+     * of kernels is covered as outputs are identical.  */
+    for (enum huffman_kernel k = 0; size != HUFFMAN_ERROR
+            && k < HUFFMAN_KERNELS; ++k) {
+        if (huffman_set_kernel(k))
+            failures += check_decode(ctx, k, in, s, b->reference, size, b,
+                checks);
+    }
+
+    huffman_ctx_free(ctx);
+
+    return failures;
+}
+
+
+unsigned check_decode(struct huffman_ctx * ctx, enum huffman_kernel k,
+    struct input const * in, struct settings const * s,
+    uint8_t const * packed, size_t size, struct buffers * b,
+    unsigned * checks)
+{
+    unsigned failures = 0;
+
+    huffman_ctx_reset(ctx);
+    ++*checks;
+    if (huffman_decompress_ctx(ctx, packed, size, b->unpacked, in->size)
+                != in->size
+            || memcmp(b->unpacked, in->data, in->size) != 0) {
+        print_settings(stderr, in, s);
+        fprintf(stderr, "%s: decompression differs\n", huffman_kernel_name(k));
+        ++failures;
+    }
+
+    /* Ranges straddle sync points and reach the end of data.  */
+    for (size_t r = 0; r < RANGES; ++r) {
+        size_t offset = in->size * r / RANGES
+            + r * 37 % (in->size / RANGES + 1);
+        size_t length = (in->size - offset) / (r + 1) + r;
+        if (offset + length > in->size)
+            length = in->size - offset;
+
+        ++*checks;
+        if (huffman_decompress_range_ctx(ctx, packed, size, offset, length,
+                    b->unpacked) != length
+                || memcmp(b->unpacked, in->data + offset, length) != 0) {
+            print_settings(stderr, in, s);
+            fprintf(stderr, "%s: range %zu:%zu differs\n",
+                huffman_kernel_name(k), offset, length);
+            ++failures;
+        }
+    }
+
+    return failures;
+}
+
+
+unsigned check_adaptive(struct input const * in, uint8_t max_code_length,
+    struct buffers * b, unsigned * checks)
+{
+    struct settings s = { 1, max_code_length, 0, 0 };
+    struct huffman_adaptive * a = huffman_adaptive_create();
+    if (a == NULL) {
+        fprintf(stderr, "test: not enough memory\n");
+        return 1;
+    }
+
+    /* Chunk sizes are not stored, so those of the first kernel are kept to
+     * decode its output.  */
+    size_t const chunk = (in->size + CHUNKS - 1) / CHUNKS;
+    size_t chunk_sizes[CHUNKS];
+    unsigned failures = 0;
+    size_t size = HUFFMAN_ERROR;
+
+    for (enum huffman_kernel k = 0; k < HUFFMAN_KERNELS; ++k) {
+        if (!huffman_set_kernel(k))
+            continue;
+
+        huffman_adaptive_reset(a);
+        huffman_adaptive_set_max_code_length(a, max_code_length);
+
+        size_t packed_size = 0;
+        for (size_t i = 0, c = 0; i < in->size
+                && packed_size != HUFFMAN_ERROR; i += chunk, ++c) {
+            size_t n = in->size - i < chunk ? in->size - i : chunk;
+            size_t chunk_size = huffman_adaptive_encode(a, in->data + i, n,
+                b->packed + packed_size, b->bound - packed_size);
+
+            if (size == HUFFMAN_ERROR)
+                chunk_sizes[c] = chunk_size;
+
+            packed_size = chunk_size == HUFFMAN_ERROR
+                ? HUFFMAN_ERROR : packed_size + chunk_size;
+        }
+
+        ++*checks;
+        if (packed_size == HUFFMAN_ERROR) {
+            print_settings(stderr, in, &s);
+            fprintf(stderr, "%s: adaptive encoding failed\n",
+                huffman_kernel_name(k));
+            ++failures;
+            break;
+        }
+
+        if (size == HUFFMAN_ERROR) {
+            size = packed_size;
+            memcpy(b->reference, b->packed, size);
+        }
+
+        else if (packed_size != size
+                || memcmp(b->packed, b->reference, size) != 0) {
+            print_settings(stderr, in, &s);
+            fprintf(stderr, "%s: adaptive output differs from %s\n",
+                huffman_kernel_name(k), huffman_kernel_name(0));
+            ++failures;
+        }
+    }
+
+    for (enum huffman_kernel k = 0; size != HUFFMAN_ERROR
+            && k < HUFFMAN_KERNELS; ++k) {
+        if (!huffman_set_kernel(k))
+            continue;
+
+        huffman_adaptive_reset(a);
+        huffman_adaptive_set_max_code_length(a, max_code_length);
+
+        bool same = true;
+        size_t offset = 0;
+        for (size_t i = 0, c = 0; same && i < in->size; i += chunk, ++c) {
+            size_t n = in->size - i < chunk ? in->size - i : chunk;
+
+            same = huffman_adaptive_decode(a, b->reference + offset,
+                    chunk_sizes[c], b->unpacked + i, in->size - i) == n
+                && memcmp(b->unpacked + i, in->data + i, n) == 0;
+
+            offset += chunk_sizes[c];
+        }
+
+        ++*checks;
+        if (!same) {
+            print_settings(stderr, in, &s);
+            fprintf(stderr, "%s: adaptive decoding differs\n",
+                huffman_kernel_name(k));
+            ++failures;
+        }
+    }
+
+    huffman_adaptive_free(a);
+
+    return failures;
+}
+
+
+void print_settings(FILE * f, struct input const * in,
+    struct settings const * s)
+{
+    fprintf(f, "test: %s of %zu bytes, %u streams, max code length %u, "
+        "%u clusters, sync interval %zu: ", in->name, in->size, s->streams,
+        s->max_code_length, s->clusters, s->sync_interval);
+}
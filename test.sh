@@ -0,0 +1,54 @@
+#!/bin/sh
+# Decompression into files huf did not open itself, which it must not
+# truncate or write at offsets of its own, see huf_decompress_file.
+
+set -u
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+huf=./huf
+failures=0
+
+fail() {
+    echo "test.sh: $1" >&2
+    failures=$((failures + 1))
+}
+
+cat huf.c huffman.c huffman.h README.md > "$dir/data"
+cat "$dir/data" "$dir/data" > "$dir/data2"
+
+for threads in 1 4; do
+    $huf -c -b 64K -T $threads "$dir/data" > "$dir/data.huf" \
+        || fail "compression with $threads threads failed"
+
+    # Appended after what is there, without cutting or overwriting it.
+    echo PRECIOUS > "$dir/log"
+    $huf -d -c -T $threads "$dir/data.huf" >> "$dir/log" \
+        || fail ">> with $threads threads failed"
+    { echo PRECIOUS; cat "$dir/data"; } | cmp -s - "$dir/log" \
+        || fail ">> with $threads threads differs"
+
+    # Appended twice.
+    $huf -d -c -T $threads "$dir/data.huf" > "$dir/out"
+    $huf -d -c -T $threads "$dir/data.huf" >> "$dir/out"
+    cmp -s "$dir/data2" "$dir/out" || fail ">> twice with $threads threads differs"
+
+    # Written over the beginning of a longer file, whose rest stays.
+    cp "$dir/data2" "$dir/out"
+    $huf -d -c -T $threads "$dir/data.huf" 1<> "$dir/out" \
+        || fail "1<> with $threads threads failed"
+    cmp -s "$dir/data2" "$dir/out" || fail "1<> with $threads threads differs"
+
+    # Truncated by the shell, then written through the index.
+    $huf -d -c -T $threads "$dir/data.huf" > "$dir/out" \
+        || fail "> with $threads threads failed"
+    cmp -s "$dir/data" "$dir/out" || fail "> with $threads threads differs"
+
+    $huf -d -f -T $threads -o "$dir/out" "$dir/data.huf" \
+        || fail "-o with $threads threads failed"
+    cmp -s "$dir/data" "$dir/out" || fail "-o with $threads threads differs"
+done
+
+echo "test.sh: $failures failed"
+[ $failures -eq 0 ]